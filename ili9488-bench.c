@@ -0,0 +1,1281 @@
+/*
+ * ili9488-bench.c - нагрузочный тест ili9488_fb и ili9488-minimal
+ *
+ * Сборка:  $(CROSS_COMPILE)gcc -O2 -Wall -o ili9488-bench ili9488-bench.c
+ *
+ * Прогоняет стандартные нагрузки через каждый путь отправки и печатает
+ * fps, перцентили задержки, CPU процесса и байты на шине:
+ *
+ *   нагрузки: full   - полный кадр, каждый раз другой цвет
+ *             sparse - SPARSE_N квадратов SPARSE_SZ в случайных местах
+ *             scroll - текстовая консоль: сдвиг на строку и новая строка
+ *             sprite - спрайт 32x32 по кругу (только ioctl)
+ *             draw   - пачка команд в атрибут draw (только sysfs)
+ *             replay - трасса damage (-t) в исходном темпе
+ *
+ *   пути:     mmap   - запись в отображение /dev/fbN (deferred IO / PTE)
+ *             write  - write() в /dev/fbN
+ *             ioctl  - ILI9488_IOC_LAYER_WRITE в слой 0, SPRITE_MOVE
+ *             sysfs  - атрибут draw драйвера ili9488-minimal
+ *
+ * Задержка кадра для ili9488_fb - от начала отправки до роста счётчика
+ * flushes в debugfs stats (опрос раз в POLL_US), так что в неё входит
+ * и DEFIO_DELAY для mmap. Байты на шине - из wire_words (9 бит на
+ * слово). Для ili9488-minimal запись в draw синхронная: задержка - время
+ * write(), байты на шине не считаются.
+ *
+ * replay: файл - содержимое debugfs .../trace (trace_depth=N), массив
+ * struct ili9488_trace_rec. События INIT и HUD порождает сам драйвер,
+ * они пропускаются. Остальные отправляются по своим ts_ns, не дожидаясь
+ * flush (как приходили от приложения): прямоугольник заливается цветом
+ * hash & 7 выбранным путём. Задержка события - до первого flush после
+ * него. Одну трассу прогоняют при разных настройках драйвера
+ * (bus_slice_us, pack_cpus, pte_damage, ...) и сравнивают отчёты,
+ * -l подписывает отчёт именем такой стратегии.
+ * Replay идёт через настоящий драйвер и шину, а не через модель на
+ * хосте: планировщик flush и упаковщики живут на workqueue, spinlock
+ * и SPI ядра, отдельной userspace-сборки у них нет. Время шины - bus_us
+ * самого драйвера (измеренное, не модельное), так что нужна плата.
+ *
+ * Регрессия (-g / -G FILE) - вместо одной нагрузки прогон набора
+ * regress_cases на модели панели драйвера (gram_model=1, HUD выключен).
+ * Каждый случай начинается с чёрного экрана, делает REGRESS_FRAMES
+ * кадров и ждёт тишины на шине. Результат - crc32 debugfs gram и
+ * wire_words за случай. -G записывает эталон в FILE, -g сверяет с ним:
+ * другая картинка или больше слов на шине - FAIL, код возврата 1.
+ * Эталон зависит от rotate и режима цвета, для каждой настройки свой.
+ * -E FILE строит эталон картинок без платы для геометрии по умолчанию
+ * (320x480, rotation 0, 3 бита): кадры те же, GRAM получается через
+ * MADCTL 0x48 как в модели. Слов на шине без платы не узнать, в таком
+ * эталоне вместо них "-" и сверяется только картинка; -G на плате
+ * записывает и то и другое. ili9488-golden-320x480.txt - такой эталон.
+ * ili9488-minimal в регрессию не входит: модели GRAM и счётчиков
+ * шины у него нет.
+ *
+ * YUV (-y FILE -z SPEC) - без устройства: кадр из файла через тот же
+ * код, что ILI9488_IOC_YUV_FRAME (ili9488_yuv.h), -n раз. Печатает
+ * crc32 результата и время на кадр, -o пишет результат в PPM.
+ * SPEC - WxH:WxH (кадр целиком, приёмник) и через ':' по желанию
+ * i420 (иначе NV12), dither, rgb332 (режим ILI9488_COLOR_18BIT).
+ *
+ * Примеры:
+ *   ili9488-bench -w full -p mmap -n 200
+ *   ili9488-bench -w sparse -p ioctl -s /sys/kernel/debug/ili9488_fb/spi0.0
+ *   ili9488-bench -w draw -p sysfs -m /sys/bus/spi/devices/spi1.0
+ *   ili9488-bench -w replay -t ui.trace -p mmap -l slice500
+ *   ili9488-bench -g ili9488-golden-320x480.txt
+ *   ili9488-bench -y cam.nv12 -z 640x480:160x120:dither -o cam.ppm
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fb.h>
+
+#include "ili9488_fb.h"
+#include "ili9488_yuv.h"
+
+#define DEBUGFS_ROOT  "/sys/kernel/debug/ili9488_fb"
+#define POLL_US       200
+#define TIMEOUT_NS    2000000000ULL
+#define SPARSE_N      16
+#define SPARSE_SZ     16
+#define LINE_H        16        /* строка консоли в пикселях */
+#define SPRITE_SZ     32
+#define SETTLE_NS     100000000ULL  /* тишина на шине: 5 x DEFIO_DELAY */
+#define REGRESS_FRAMES 8
+#define MINIMAL_W     320           /* ili9488-minimal: зашито в probe */
+#define MINIMAL_H     480
+#define NO_BUDGET     UINT64_MAX    /* "-" в эталоне: слова не сверяются */
+
+enum { W_FULL, W_SPARSE, W_SCROLL, W_SPRITE, W_DRAW, W_REPLAY };
+enum { P_MMAP, P_WRITE, P_IOCTL, P_SYSFS };
+
+static const char *const wl_names[]   = { "full", "sparse", "scroll",
+					  "sprite", "draw", "replay" };
+static const char *const path_names[] = { "mmap", "write", "ioctl",
+					  "sysfs" };
+
+struct bench {
+	int       workload;
+	int       path;
+	int       frames;
+	const char *fbdev;
+	char       stats[320];     /* debugfs .../stats, "" - нет */
+	char       draw[320];      /* sysfs .../draw */
+
+	int       fd;
+	uint8_t  *map;             /* mmap /dev/fbN */
+	uint8_t  *frame;           /* копия кадра для write / ioctl */
+	uint8_t  *blit;            /* прямоугольник для ILI9488_IOC_LAYER_WRITE */
+	uint8_t  *fill;            /* заливка события replay */
+	int       width, height;
+	int       line;            /* байт на строку */
+
+	uint64_t *lat_ns;
+	uint64_t  cpu_ns;          /* CPU процесса на отправку */
+
+	const char *label;         /* -l: имя стратегии в отчёте */
+	struct ili9488_trace_rec *trace;   /* -w replay */
+};
+
+/* значения из debugfs stats, нужные тесту */
+struct stats {
+	uint64_t flushes;
+	uint64_t wire_words;
+	uint64_t bus_us;
+	uint64_t preempts;
+};
+
+/*
+ * Свой генератор вместо rand(): последовательность одна и та же с любой
+ * libc, иначе эталон с хоста не совпал бы с прогоном на плате.
+ */
+static uint32_t rnd_state = 1;
+
+static void bench_srand(uint32_t seed)
+{
+	rnd_state = seed ? seed : 1;
+}
+
+static int bench_rand(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state >> 1;
+}
+
+static uint64_t now_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int find_first_dir(const char *root, char *out, size_t len)
+{
+	struct dirent *de;
+	DIR *d = opendir(root);
+
+	if (!d)
+		return -1;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(out, len, "%s/%s", root, de->d_name);
+		closedir(d);
+		return 0;
+	}
+	closedir(d);
+	return -1;
+}
+
+/* строки "ключ: число"; остальные (hex, текст, гистограммы) пропускаются */
+static int read_stats(const struct bench *b, struct stats *st)
+{
+	char line[128], key[64];
+	unsigned long long val;
+	FILE *f = fopen(b->stats, "r");
+
+	if (!f)
+		return -1;
+	memset(st, 0, sizeof(*st));
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%63[^:]: %llu", key, &val) != 2)
+			continue;
+		if (!strcmp(key, "flushes"))
+			st->flushes = val;
+		else if (!strcmp(key, "wire_words"))
+			st->wire_words = val;
+		else if (!strcmp(key, "bus_us"))
+			st->bus_us = val;
+		else if (!strcmp(key, "preempts"))
+			st->preempts = val;
+	}
+	fclose(f);
+	return 0;
+}
+
+/* дождаться flush после отправки: flushes > before */
+static int wait_flush(const struct bench *b, uint64_t before)
+{
+	uint64_t t0 = now_ns(CLOCK_MONOTONIC);
+	struct stats st;
+
+	for (;;) {
+		if (read_stats(b, &st))
+			return -1;
+		if (st.flushes > before)
+			return 0;
+		if (now_ns(CLOCK_MONOTONIC) - t0 > TIMEOUT_NS)
+			return -1;
+		usleep(POLL_US);
+	}
+}
+
+/* ------------------------------------------------------------------ */
+/* Отправка                                                             */
+/* ------------------------------------------------------------------ */
+
+static int put_rect(struct bench *b, int x, int y, int w, int h,
+		    const uint8_t *src, int pitch)
+{
+	int row;
+
+	switch (b->path) {
+	case P_MMAP:
+		for (row = 0; row < h; row++)
+			memcpy(b->map + (y + row) * b->line + x,
+			       src + row * pitch, w);
+		return 0;
+	case P_WRITE:
+		/* write() идёт только целыми строками от начала */
+		for (row = 0; row < h; row++)
+			memcpy(b->frame + (y + row) * b->line + x,
+			       src + row * pitch, w);
+		if (pwrite(b->fd, b->frame + y * b->line, h * b->line,
+			   (off_t)y * b->line) != h * b->line)
+			return -1;
+		return 0;
+	case P_IOCTL: {
+		struct ili9488_layer_blit blit = {
+			.index = 0,
+			.x = x, .y = y, .w = w, .h = h,
+		};
+
+		for (row = 0; row < h; row++)
+			memcpy(b->blit + row * w, src + row * pitch, w);
+		blit.data = (uintptr_t)b->blit;
+		return ioctl(b->fd, ILI9488_IOC_LAYER_WRITE, &blit);
+	}
+	}
+	return -1;
+}
+
+static int do_full(struct bench *b, int i)
+{
+	memset(b->frame, i & 7, b->line * b->height);
+	if (b->path == P_MMAP) {
+		memcpy(b->map, b->frame, b->line * b->height);
+		return 0;
+	}
+	if (b->path == P_WRITE)
+		return pwrite(b->fd, b->frame, b->line * b->height, 0) ==
+		       b->line * b->height ? 0 : -1;
+	return put_rect(b, 0, 0, b->width, b->height, b->frame, b->line);
+}
+
+static int do_sparse(struct bench *b, int i)
+{
+	uint8_t sq[SPARSE_SZ * SPARSE_SZ];
+	int k;
+
+	for (k = 0; k < SPARSE_N; k++) {
+		int x = bench_rand() % (b->width - SPARSE_SZ);
+		int y = bench_rand() % (b->height - SPARSE_SZ);
+
+		memset(sq, (i + k) & 7, sizeof(sq));
+		if (put_rect(b, x, y, SPARSE_SZ, SPARSE_SZ, sq, SPARSE_SZ))
+			return -1;
+	}
+	return 0;
+}
+
+/* сдвиг на LINE_H вверх, внизу новая "строка текста" из полос */
+static int do_scroll(struct bench *b, int i)
+{
+	int rows = b->height - LINE_H;
+	uint8_t *dst = b->path == P_MMAP ? b->map : b->frame;
+	int x, y;
+
+	memmove(dst, dst + LINE_H * b->line, rows * b->line);
+	for (y = 0; y < LINE_H; y++)
+		for (x = 0; x < b->width; x++)
+			dst[(rows + y) * b->line + x] =
+				((x / 8 + i) % 5 && y > 2 && y < 13) ? 7 : 0;
+
+	switch (b->path) {
+	case P_MMAP:
+		return 0;
+	case P_WRITE:
+		return pwrite(b->fd, b->frame, b->line * b->height, 0) ==
+		       b->line * b->height ? 0 : -1;
+	default:
+		return put_rect(b, 0, 0, b->width, b->height, b->frame,
+				b->line);
+	}
+}
+
+/* sin(ph * 2pi / 64) * 64 по четверти периода, без libm */
+static int sin64(int ph)
+{
+	static const unsigned char t[17] = {
+		0, 6, 12, 19, 24, 30, 36, 41, 45, 49, 53, 56, 59, 61, 63, 64, 64
+	};
+	int k = ph & 15;
+
+	switch ((ph >> 4) & 3) {
+	case 0:
+		return t[k];
+	case 1:
+		return t[16 - k];
+	case 2:
+		return -t[k];
+	default:
+		return -t[16 - k];
+	}
+}
+
+/* спрайт по окружности, круг за 64 кадра */
+static void sprite_pos(const struct bench *b, int i,
+		       struct ili9488_sprite_pos *pos)
+{
+	int r = (b->height < b->width ? b->height : b->width) / 3;
+
+	pos->x = b->width / 2 + sin64(i + 16) * r / 64 - SPRITE_SZ / 2;
+	pos->y = b->height / 2 + sin64(i) * r / 64 - SPRITE_SZ / 2;
+	pos->visible = 1;
+}
+
+static int do_sprite(struct bench *b, int i)
+{
+	struct ili9488_sprite_pos pos;
+
+	sprite_pos(b, i, &pos);
+	return ioctl(b->fd, ILI9488_IOC_SPRITE_MOVE, &pos);
+}
+
+static int do_draw(struct bench *b, int i)
+{
+	char cmd[64];
+	int fd = open(b->draw, O_WRONLY);
+	int k, ret = 0;
+
+	if (fd < 0)
+		return -1;
+	for (k = 0; k < SPARSE_N && !ret; k++) {
+		int n = snprintf(cmd, sizeof(cmd), "rect %d %d %d %d %d fill",
+				 bench_rand() % (b->width - SPARSE_SZ),
+				 bench_rand() % (b->height - SPARSE_SZ),
+				 SPARSE_SZ, SPARSE_SZ, (i + k) & 7);
+
+		ret = write(fd, cmd, n) == n ? 0 : -1;
+	}
+	close(fd);
+	return ret;
+}
+
+/* событие трассы i: прямоугольник цветом hash & 7 */
+static int do_replay(struct bench *b, int i)
+{
+	const struct ili9488_trace_rec *rec = &b->trace[i];
+	int x1 = rec->x1 < b->width ? rec->x1 : b->width - 1;
+	int y1 = rec->y1 < b->height ? rec->y1 : b->height - 1;
+	int w  = x1 - rec->x0 + 1;
+	int h  = y1 - rec->y0 + 1;
+
+	if (w <= 0 || h <= 0)
+		return 0;
+	memset(b->fill, rec->hash & 7, (size_t)w * h);
+	return put_rect(b, rec->x0, rec->y0, w, h, b->fill, w);
+}
+
+static int submit(struct bench *b, int i)
+{
+	switch (b->workload) {
+	case W_FULL:
+		return do_full(b, i);
+	case W_SPARSE:
+		return do_sparse(b, i);
+	case W_SCROLL:
+		return do_scroll(b, i);
+	case W_SPRITE:
+		return do_sprite(b, i);
+	case W_DRAW:
+		return do_draw(b, i);
+	case W_REPLAY:
+		return do_replay(b, i);
+	}
+	return -1;
+}
+
+/* ------------------------------------------------------------------ */
+/* Подготовка                                                           */
+/* ------------------------------------------------------------------ */
+
+static int setup_fb(struct bench *b)
+{
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+	size_t size;
+
+	b->fd = open(b->fbdev, O_RDWR);
+	if (b->fd < 0) {
+		perror(b->fbdev);
+		return -1;
+	}
+	if (ioctl(b->fd, FBIOGET_VSCREENINFO, &var) ||
+	    ioctl(b->fd, FBIOGET_FSCREENINFO, &fix)) {
+		perror("FBIOGET_*SCREENINFO");
+		return -1;
+	}
+	b->width  = var.xres;
+	b->height = var.yres;
+	b->line   = fix.line_length;
+	size      = (size_t)b->line * b->height;
+
+	b->frame = calloc(1, size);
+	b->blit  = calloc(1, size);
+	b->fill  = calloc(1, size);
+	if (!b->frame || !b->blit || !b->fill)
+		return -1;
+
+	if (b->path == P_MMAP) {
+		b->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			      b->fd, 0);
+		if (b->map == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+	}
+
+	if (b->path == P_IOCTL && b->workload != W_SPRITE) {
+		struct ili9488_layer_cfg cfg = { .index = 0, .enable = 1,
+						 .key = 0xFF };
+
+		if (ioctl(b->fd, ILI9488_IOC_LAYER_SET, &cfg)) {
+			perror("ILI9488_IOC_LAYER_SET");
+			return -1;
+		}
+	}
+
+	if (b->workload == W_SPRITE) {
+		static uint8_t img[SPRITE_SZ * SPRITE_SZ];
+		static uint8_t mask[SPRITE_SZ * SPRITE_SZ / 8];
+		struct ili9488_sprite_img si = {
+			.w = SPRITE_SZ, .h = SPRITE_SZ,
+			.data = (uintptr_t)img, .mask = (uintptr_t)mask,
+		};
+
+		memset(img, 0x06, sizeof(img));
+		memset(mask, 0xFF, sizeof(mask));
+		if (ioctl(b->fd, ILI9488_IOC_SPRITE_SET, &si)) {
+			perror("ILI9488_IOC_SPRITE_SET");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void teardown_fb(struct bench *b)
+{
+	if (b->path == P_IOCTL && b->workload != W_SPRITE) {
+		struct ili9488_layer_cfg cfg = { .index = 0, .enable = 0 };
+
+		ioctl(b->fd, ILI9488_IOC_LAYER_SET, &cfg);
+	}
+	if (b->workload == W_SPRITE) {
+		struct ili9488_sprite_pos pos = { 0 };
+
+		ioctl(b->fd, ILI9488_IOC_SPRITE_MOVE, &pos);
+	}
+	if (b->map)
+		munmap(b->map, (size_t)b->line * b->height);
+	free(b->frame);
+	free(b->blit);
+	free(b->fill);
+	close(b->fd);
+	b->map = NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* Replay                                                               */
+/* ------------------------------------------------------------------ */
+
+/* события приложения из файла трассы; INIT и HUD - от самого драйвера */
+static int load_trace(struct bench *b, const char *path, int max)
+{
+	struct ili9488_trace_rec rec;
+	FILE *f = fopen(path, "rb");
+	int n = 0, cap = 0;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	while ((max <= 0 || n < max) &&
+	       fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (rec.source == ILI9488_SRC_INIT ||
+		    rec.source == ILI9488_SRC_HUD)
+			continue;
+		if (rec.x0 > rec.x1 || rec.y0 > rec.y1)
+			continue;
+		if (n == cap) {
+			struct ili9488_trace_rec *t;
+
+			cap = cap ? cap * 2 : 256;
+			t = realloc(b->trace, cap * sizeof(*t));
+			if (!t) {
+				fclose(f);
+				return -1;
+			}
+			b->trace = t;
+		}
+		b->trace[n++] = rec;
+	}
+	fclose(f);
+	if (!n) {
+		fprintf(stderr, "%s: no replayable events\n", path);
+		return -1;
+	}
+	b->frames = n;
+	return 0;
+}
+
+/*
+ * Событие i уходит в t0 + (ts_ns[i] - ts_ns[0]), ожидание между
+ * событиями - опрос stats. Каждый рост flushes закрывает все события,
+ * отправленные до чтения, которое его увидело.
+ */
+static int run_replay(struct bench *b)
+{
+	uint64_t *sub_ns = calloc(b->frames, sizeof(*sub_ns));
+	uint64_t *sub_fl = calloc(b->frames, sizeof(*sub_fl));
+	uint64_t t0, ts, cpu;
+	struct stats st;
+	int i = 0, done = 0, ret = -1;
+
+	if (!sub_ns || !sub_fl)
+		goto out;
+
+	t0 = now_ns(CLOCK_MONOTONIC);
+	while (done < b->frames) {
+		uint64_t due = i < b->frames ?
+			t0 + (b->trace[i].ts_ns - b->trace[0].ts_ns) : 0;
+
+		if (read_stats(b, &st))
+			goto out;
+		ts = now_ns(CLOCK_MONOTONIC);
+		while (done < i && st.flushes > sub_fl[done]) {
+			b->lat_ns[done] = ts - sub_ns[done];
+			done++;
+		}
+
+		if (i < b->frames && ts >= due) {
+			cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+			sub_ns[i] = ts;
+			sub_fl[i] = st.flushes;
+			if (submit(b, i)) {
+				fprintf(stderr, "event %d: %s\n", i,
+					strerror(errno));
+				goto out;
+			}
+			b->cpu_ns += now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+			i++;
+			continue;
+		}
+
+		if (i == b->frames && ts - sub_ns[i - 1] > TIMEOUT_NS) {
+			fprintf(stderr, "event %d: no flush\n", done);
+			goto out;
+		}
+		usleep(i < b->frames && due - ts < POLL_US * 1000ULL ?
+		       (due - ts) / 1000 : POLL_US);
+	}
+	ret = 0;
+out:
+	free(sub_ns);
+	free(sub_fl);
+	return ret;
+}
+
+/* ------------------------------------------------------------------ */
+/* Регрессия                                                            */
+/* ------------------------------------------------------------------ */
+
+static const struct {
+	int workload, path;
+} regress_cases[] = {
+	{ W_FULL,   P_MMAP  }, { W_FULL,   P_WRITE }, { W_FULL,   P_IOCTL },
+	{ W_SPARSE, P_MMAP  }, { W_SPARSE, P_WRITE }, { W_SPARSE, P_IOCTL },
+	{ W_SCROLL, P_MMAP  }, { W_SCROLL, P_WRITE }, { W_SCROLL, P_IOCTL },
+	{ W_SPRITE, P_IOCTL },
+};
+
+#define N_CASES (int)(sizeof(regress_cases) / sizeof(regress_cases[0]))
+
+static uint32_t crc32_buf(const uint8_t *p, size_t n)
+{
+	uint32_t crc = ~0U;
+	int k;
+
+	while (n--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xEDB88320U & -(crc & 1));
+	}
+	return ~crc;
+}
+
+/* flushes не меняется SETTLE_NS: всё отправленное дошло до панели */
+static int settle(const struct bench *b, struct stats *st)
+{
+	uint64_t t0 = now_ns(CLOCK_MONOTONIC), last = t0, prev;
+
+	if (read_stats(b, st))
+		return -1;
+	prev = st->flushes;
+	for (;;) {
+		uint64_t t;
+
+		usleep(POLL_US * 10);
+		if (read_stats(b, st))
+			return -1;
+		t = now_ns(CLOCK_MONOTONIC);
+		if (st->flushes != prev) {
+			prev = st->flushes;
+			last = t;
+		} else if (t - last >= SETTLE_NS) {
+			return 0;
+		}
+		if (t - t0 > TIMEOUT_NS)
+			return -1;
+	}
+}
+
+static int regress_case(struct bench *b, const char *gram,
+			uint32_t *crc, uint64_t *words)
+{
+	uint8_t *img = NULL;
+	size_t size;
+	ssize_t n;
+	struct stats s0, s1;
+	int i, fd, ret = -1;
+
+	if (setup_fb(b))
+		return -1;
+	size = (size_t)b->line * b->height;
+
+	/* с чёрного экрана */
+	memset(b->frame, 0, size);
+	if (pwrite(b->fd, b->frame, size, 0) != (ssize_t)size ||
+	    settle(b, &s0))
+		goto out;
+
+	bench_srand(1);
+	for (i = 0; i < REGRESS_FRAMES; i++) {
+		struct stats st;
+
+		if (read_stats(b, &st) || submit(b, i) ||
+		    wait_flush(b, st.flushes))
+			goto out;
+	}
+	if (settle(b, &s1))
+		goto out;
+
+	/* GRAM первой панели: не больше экрана из FBIOGET_VSCREENINFO */
+	img = malloc((size_t)b->width * b->height);
+	fd  = open(gram, O_RDONLY);
+	if (!img || fd < 0) {
+		perror(gram);
+		goto out;
+	}
+	n = read(fd, img, (size_t)b->width * b->height);
+	if (n > 0) {
+		*crc   = crc32_buf(img, n);
+		*words = s1.wire_words - s0.wire_words;
+		ret = 0;
+	}
+	close(fd);
+out:
+	free(img);
+	teardown_fb(b);
+	return ret;
+}
+
+/*
+ * Картинка GRAM случая i без платы: те же кадры в память, затем как
+ * модель при MADCTL 0x48 (rotation 0): столбец зеркально, x -> 319 - x.
+ */
+static int regress_expect_case(int i, uint32_t *crc)
+{
+	struct bench e = {
+		.workload = regress_cases[i].workload,
+		.path     = P_MMAP,
+		.width    = MINIMAL_W,
+		.height   = MINIMAL_H,
+		.line     = MINIMAL_W,
+	};
+	size_t size = (size_t)MINIMAL_W * MINIMAL_H;
+	uint8_t *gram = malloc(size);
+	int k, x, y, ret = -1;
+
+	e.map   = calloc(1, size);
+	e.frame = calloc(1, size);
+	e.blit  = calloc(1, size);
+	e.fill  = calloc(1, size);
+	if (!gram || !e.map || !e.frame || !e.blit || !e.fill)
+		goto out;
+
+	bench_srand(1);
+	if (e.workload == W_SPRITE) {
+		struct ili9488_sprite_pos pos;
+
+		/* картинка 0x06, маска целиком */
+		sprite_pos(&e, REGRESS_FRAMES - 1, &pos);
+		for (y = pos.y; y < pos.y + SPRITE_SZ; y++)
+			for (x = pos.x; x < pos.x + SPRITE_SZ; x++)
+				if (x >= 0 && x < e.width &&
+				    y >= 0 && y < e.height)
+					e.map[y * e.line + x] = 0x06;
+	} else {
+		for (k = 0; k < REGRESS_FRAMES; k++)
+			if (submit(&e, k))
+				goto out;
+	}
+
+	for (y = 0; y < e.height; y++)
+		for (x = 0; x < e.width; x++)
+			gram[y * e.width + e.width - 1 - x] =
+				e.map[y * e.line + x] & 0x07;
+	*crc = crc32_buf(gram, size);
+	ret = 0;
+out:
+	free(gram);
+	free(e.map);
+	free(e.frame);
+	free(e.blit);
+	free(e.fill);
+	return ret;
+}
+
+/* -E: эталон картинок для 320x480 без платы, слова - "-" */
+static int regress_expect(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	uint32_t crc;
+	int i;
+
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	fprintf(f, "# case crc32 wire_words, REGRESS_FRAMES %d\n",
+		REGRESS_FRAMES);
+	fprintf(f, "# %dx%d, rotation 0, 3-bit, from ili9488-bench -E\n",
+		MINIMAL_W, MINIMAL_H);
+	for (i = 0; i < N_CASES; i++) {
+		if (regress_expect_case(i, &crc)) {
+			fclose(f);
+			return 1;
+		}
+		fprintf(f, "%s-%s %08x -\n",
+			wl_names[regress_cases[i].workload],
+			path_names[regress_cases[i].path], crc);
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * update: записать эталон в path. Иначе сверить: картинка должна
+ * совпасть, слов на шине - не больше эталона.
+ */
+static int regress(struct bench *b, const char *dir, const char *path,
+		   int update)
+{
+	uint32_t gold_crc[N_CASES] = { 0 };
+	uint64_t gold_words[N_CASES] = { 0 };
+	int      gold_found[N_CASES] = { 0 };
+	char gram[320], name[32], line[128], words_s[32];
+	FILE *f;
+	int i, fail = 0;
+
+	snprintf(gram, sizeof(gram), "%s/gram", dir);
+
+	if (!update) {
+		f = fopen(path, "r");
+		if (!f) {
+			perror(path);
+			return 1;
+		}
+		while (fgets(line, sizeof(line), f)) {
+			unsigned int crc;
+
+			if (line[0] == '#' ||
+			    sscanf(line, "%31s %x %31s", name, &crc,
+				   words_s) != 3)
+				continue;
+			for (i = 0; i < N_CASES; i++) {
+				char want[32];
+
+				snprintf(want, sizeof(want), "%s-%s",
+					 wl_names[regress_cases[i].workload],
+					 path_names[regress_cases[i].path]);
+				if (!strcmp(want, name)) {
+					gold_crc[i]   = crc;
+					gold_words[i] = strcmp(words_s, "-") ?
+						strtoull(words_s, NULL, 10) :
+						NO_BUDGET;
+					gold_found[i] = 1;
+				}
+			}
+		}
+		fclose(f);
+		f = NULL;
+	} else {
+		f = fopen(path, "w");
+		if (!f) {
+			perror(path);
+			return 1;
+		}
+		fprintf(f, "# case crc32 wire_words, REGRESS_FRAMES %d\n",
+			REGRESS_FRAMES);
+	}
+
+	for (i = 0; i < N_CASES; i++) {
+		uint32_t crc;
+		uint64_t words;
+
+		b->workload = regress_cases[i].workload;
+		b->path     = regress_cases[i].path;
+		snprintf(name, sizeof(name), "%s-%s", wl_names[b->workload],
+			 path_names[b->path]);
+
+		if (regress_case(b, gram, &crc, &words)) {
+			printf("%s: FAIL run\n", name);
+			fail = 1;
+			continue;
+		}
+		if (f) {
+			fprintf(f, "%s %08x %llu\n", name, crc,
+				(unsigned long long)words);
+			printf("%s: %08x %llu\n", name, crc,
+			       (unsigned long long)words);
+		} else if (!gold_found[i]) {
+			printf("%s: FAIL no golden entry\n", name);
+			fail = 1;
+		} else if (crc != gold_crc[i]) {
+			printf("%s: FAIL image %08x, golden %08x\n", name, crc,
+			       gold_crc[i]);
+			fail = 1;
+		} else if (words > gold_words[i]) {
+			printf("%s: FAIL wire_words %llu, golden %llu\n", name,
+			       (unsigned long long)words,
+			       (unsigned long long)gold_words[i]);
+			fail = 1;
+		} else if (gold_words[i] == NO_BUDGET) {
+			printf("%s: ok, wire_words %llu (no golden)\n", name,
+			       (unsigned long long)words);
+		} else {
+			printf("%s: ok, wire_words %llu (golden %llu)\n", name,
+			       (unsigned long long)words,
+			       (unsigned long long)gold_words[i]);
+		}
+	}
+
+	if (f)
+		fclose(f);
+	return fail;
+}
+
+/* ------------------------------------------------------------------ */
+/* YUV на хосте                                                         */
+/* ------------------------------------------------------------------ */
+
+/* как ili9488_yuv_frame(), но кадр уже в памяти и приёмник - out */
+static void yuv_convert(const struct ili9488_yuv_frame *f, const uint8_t *base,
+			uint32_t *acc, uint16_t *xmap, uint8_t *out,
+			int rgb332)
+{
+	int nv12 = f->format == ILI9488_YUV_NV12;
+	uint64_t cbase   = (uint64_t)f->stride * f->height;
+	uint64_t cstride = nv12 ? f->stride : (f->stride + 1) / 2;
+	int cx0 = f->crop_x / 2;
+	int cn  = (f->crop_x + f->crop_w - 1) / 2 - cx0 + 1;
+	uint32_t *cnt = acc + 3 * f->w;
+	static uint8_t cbuf[2 * (65535 / 2 + 1)];    /* 2 * cn */
+	int sx, sy, dy = 0;
+
+	for (sx = 0; sx < f->crop_w; sx++)
+		xmap[sx] = sx * f->w / f->crop_w;
+	memset(acc, 0, 4 * f->w * sizeof(uint32_t));
+
+	for (sy = f->crop_y; sy < f->crop_y + f->crop_h; sy++) {
+		int ndy = (sy - f->crop_y) * f->h / f->crop_h;
+		const uint8_t *crow = base + cbase + (sy / 2) * cstride;
+
+		if (ndy != dy) {
+			ili9488_yuv_emit_row(f, dy, acc, cnt,
+					     out + (f->y + dy) * f->w, rgb332);
+			memset(acc, 0, 4 * f->w * sizeof(uint32_t));
+			dy = ndy;
+		}
+		if (nv12) {
+			memcpy(cbuf, crow + 2 * cx0, 2 * cn);
+		} else {
+			memcpy(cbuf, crow + cx0, cn);
+			memcpy(cbuf + cn, crow + cx0 +
+			       cstride * ((f->height + 1) / 2), cn);
+		}
+		ili9488_yuv_acc_row(f, acc, cnt, xmap,
+				    base + (uint64_t)sy * f->stride + f->crop_x,
+				    cbuf, cx0, cn);
+	}
+	ili9488_yuv_emit_row(f, dy, acc, cnt, out + (f->y + dy) * f->w,
+			     rgb332);
+}
+
+/* байт vmem -> RGB888 для PPM */
+static void yuv_rgb(uint8_t px, int rgb332, uint8_t *rgb)
+{
+	if (rgb332) {
+		rgb[0] = ((px >> 5) & 7) * 255 / 7;
+		rgb[1] = ((px >> 2) & 7) * 255 / 7;
+		rgb[2] = (px & 3) * 85;
+	} else {
+		rgb[0] = px & 4 ? 255 : 0;
+		rgb[1] = px & 2 ? 255 : 0;
+		rgb[2] = px & 1 ? 255 : 0;
+	}
+}
+
+static int yuv_file(const char *path, const char *spec, const char *out,
+		    int runs)
+{
+	struct ili9488_yuv_frame f = { 0 };
+	int sw, sh, dw, dh, rgb332 = !!strstr(spec, ":rgb332");
+	uint8_t *frame, *img;
+	uint32_t *acc;
+	uint16_t *xmap;
+	size_t size;
+	uint64_t t0;
+	FILE *fp;
+	int i, ret = 1;
+
+	if (sscanf(spec, "%dx%d:%dx%d", &sw, &sh, &dw, &dh) != 4 ||
+	    sw < 2 || sh < 2 || sw > 65535 || sh > 65535 ||
+	    dw < 1 || dh < 1 || dw > sw || dh > sh ||
+	    (uint64_t)sw * sh > ((uint64_t)dw * dh) << 16) {
+		fprintf(stderr, "bad -z %s\n", spec);
+		return 2;
+	}
+	f.format = strstr(spec, ":i420") ? ILI9488_YUV_I420 : ILI9488_YUV_NV12;
+	f.dither = strstr(spec, ":dither") ? ILI9488_DITHER_ORDERED :
+					     ILI9488_DITHER_NONE;
+	f.width  = f.crop_w = sw;
+	f.height = f.crop_h = sh;
+	f.stride = sw;
+	f.w = dw;
+	f.h = dh;
+
+	/* Y + цветность: NV12 - stride на строку, I420 - две по половине */
+	size = (size_t)sw * sh + (size_t)(f.format == ILI9488_YUV_NV12 ?
+		sw : 2 * ((sw + 1) / 2)) * ((sh + 1) / 2);
+	frame = malloc(size);
+	img   = malloc((size_t)dw * dh);
+	acc   = malloc(4 * dw * sizeof(*acc));
+	xmap  = malloc(sw * sizeof(*xmap));
+	if (!frame || !img || !acc || !xmap)
+		goto out;
+
+	fp = fopen(path, "rb");
+	if (!fp || fread(frame, 1, size, fp) != size) {
+		fprintf(stderr, "%s: need %zu bytes\n", path, size);
+		if (fp)
+			fclose(fp);
+		goto out;
+	}
+	fclose(fp);
+
+	t0 = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+	for (i = 0; i < runs; i++)
+		yuv_convert(&f, frame, acc, xmap, img, rgb332);
+	t0 = now_ns(CLOCK_PROCESS_CPUTIME_ID) - t0;
+
+	printf("yuv_crc32: %08x\n", crc32_buf(img, (size_t)dw * dh));
+	printf("yuv_us_per_frame: %llu\n",
+	       (unsigned long long)(t0 / runs / 1000));
+
+	if (out) {
+		fp = fopen(out, "wb");
+		if (!fp) {
+			perror(out);
+			goto out;
+		}
+		fprintf(fp, "P6\n%d %d\n255\n", dw, dh);
+		for (i = 0; i < dw * dh; i++) {
+			uint8_t rgb[3];
+
+			yuv_rgb(img[i], rgb332, rgb);
+			fwrite(rgb, 1, 3, fp);
+		}
+		fclose(fp);
+	}
+	ret = 0;
+out:
+	free(frame);
+	free(img);
+	free(acc);
+	free(xmap);
+	return ret;
+}
+
+/* ------------------------------------------------------------------ */
+/* Отчёт                                                                */
+/* ------------------------------------------------------------------ */
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t pct(const uint64_t *v, int n, int p)
+{
+	int i = (n * p + 99) / 100 - 1;
+
+	return v[i < 0 ? 0 : i];
+}
+
+static void report(struct bench *b, int n, uint64_t wall_ns,
+		   const struct stats *s0, const struct stats *s1)
+{
+	qsort(b->lat_ns, n, sizeof(*b->lat_ns), cmp_u64);
+
+	if (b->label)
+		printf("strategy: %s\n", b->label);
+	printf("workload: %s\n", wl_names[b->workload]);
+	printf("path: %s\n", path_names[b->path]);
+	printf("frames: %d\n", n);
+	printf("fps: %.1f\n", n * 1e9 / wall_ns);
+	printf("lat_p50_us: %llu\n",
+	       (unsigned long long)pct(b->lat_ns, n, 50) / 1000);
+	printf("lat_p90_us: %llu\n",
+	       (unsigned long long)pct(b->lat_ns, n, 90) / 1000);
+	printf("lat_p99_us: %llu\n",
+	       (unsigned long long)pct(b->lat_ns, n, 99) / 1000);
+	printf("lat_max_us: %llu\n",
+	       (unsigned long long)b->lat_ns[n - 1] / 1000);
+	printf("cpu_us_per_frame: %llu\n",
+	       (unsigned long long)(b->cpu_ns / n / 1000));
+
+	if (!s0)
+		return;
+	printf("flushes: %llu\n",
+	       (unsigned long long)(s1->flushes - s0->flushes));
+	printf("wire_bytes: %llu\n",
+	       (unsigned long long)((s1->wire_words - s0->wire_words) * 9 / 8));
+	printf("wire_bytes_per_frame: %llu\n",
+	       (unsigned long long)((s1->wire_words - s0->wire_words) * 9 / 8 / n));
+	printf("bus_us: %llu\n", (unsigned long long)(s1->bus_us - s0->bus_us));
+	printf("bus_util_pct: %.1f\n",
+	       (s1->bus_us - s0->bus_us) * 1e5 / wall_ns);
+	printf("preempts: %llu\n",
+	       (unsigned long long)(s1->preempts - s0->preempts));
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-w full|sparse|scroll|sprite|draw|replay]\n"
+		"          [-p mmap|write|ioctl|sysfs] [-n frames]\n"
+		"          [-f /dev/fbN] [-s debugfs-dir] [-m sysfs-dir]\n"
+		"          [-t trace-file] [-l strategy-label]\n"
+		"       %s -g|-G golden-file [-f /dev/fbN] [-s debugfs-dir]\n"
+		"       %s -E golden-file\n"
+		"       %s -y yuv-file -z WxH:WxH[:i420][:dither][:rgb332]\n"
+		"          [-n runs] [-o out.ppm]\n",
+		prog, prog, prog, prog);
+}
+
+static int lookup(const char *const *names, int n, const char *s)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (!strcmp(names[i], s))
+			return i;
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b = {
+		.workload = W_FULL,
+		.path     = P_MMAP,
+		.frames   = 100,
+		.fbdev    = "/dev/fb0",
+	};
+	struct stats s0, s1;
+	const char *dbg = NULL, *sys = NULL, *trace = NULL, *golden = NULL;
+	const char *yuv = NULL, *yuv_spec = NULL, *yuv_out = NULL;
+	const char *expect = NULL;
+	uint64_t t0;
+	int i, opt, ret = 0, nmax = 0, update = 0;
+
+	while ((opt = getopt(argc, argv, "w:p:n:f:s:m:t:l:g:G:E:y:z:o:h")) != -1) {
+		switch (opt) {
+		case 'w':
+			b.workload = lookup(wl_names, 6, optarg);
+			break;
+		case 'p':
+			b.path = lookup(path_names, 4, optarg);
+			break;
+		case 'n':
+			b.frames = nmax = atoi(optarg);
+			break;
+		case 'f':
+			b.fbdev = optarg;
+			break;
+		case 's':
+			dbg = optarg;
+			break;
+		case 'm':
+			sys = optarg;
+			break;
+		case 't':
+			trace = optarg;
+			break;
+		case 'l':
+			b.label = optarg;
+			break;
+		case 'G':
+			update = 1;
+			/* fall through */
+		case 'g':
+			golden = optarg;
+			break;
+		case 'E':
+			expect = optarg;
+			break;
+		case 'y':
+			yuv = optarg;
+			break;
+		case 'z':
+			yuv_spec = optarg;
+			break;
+		case 'o':
+			yuv_out = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (expect)
+		return regress_expect(expect);
+	if (yuv) {
+		if (!yuv_spec || b.frames <= 0) {
+			usage(argv[0]);
+			return 2;
+		}
+		return yuv_file(yuv, yuv_spec, yuv_out, b.frames);
+	}
+	if (b.workload < 0 || b.path < 0 || b.frames <= 0 ||
+	    (b.workload == W_SPRITE && b.path != P_IOCTL) ||
+	    ((b.workload == W_DRAW) != (b.path == P_SYSFS)) ||
+	    (b.path == P_SYSFS && !sys) ||
+	    ((b.workload == W_REPLAY) != !!trace) ||
+	    (b.workload == W_REPLAY && b.path > P_IOCTL)) {
+		usage(argv[0]);
+		return 2;
+	}
+	/* -n для replay - не больше стольких событий трассы */
+	if (trace && load_trace(&b, trace, nmax))
+		return 1;
+
+	b.lat_ns = calloc(b.frames, sizeof(*b.lat_ns));
+	if (!b.lat_ns)
+		return 1;
+	bench_srand(1);      /* одинаковые прямоугольники от прогона к прогону */
+
+	if (b.path == P_SYSFS) {
+		snprintf(b.draw, sizeof(b.draw), "%s/draw", sys);
+		b.width  = MINIMAL_W;
+		b.height = MINIMAL_H;
+	} else {
+		char dir[300];
+
+		if (dbg)
+			snprintf(dir, sizeof(dir), "%s", dbg);
+		else if (find_first_dir(DEBUGFS_ROOT, dir, sizeof(dir))) {
+			fprintf(stderr, "no %s, use -s\n", DEBUGFS_ROOT);
+			return 1;
+		}
+		snprintf(b.stats, sizeof(b.stats), "%s/stats", dir);
+		if (golden) {
+			ret = regress(&b, dir, golden, update);
+			free(b.lat_ns);
+			return ret;
+		}
+		if (setup_fb(&b))
+			return 1;
+	}
+
+	if (b.stats[0] && read_stats(&b, &s0)) {
+		perror(b.stats);
+		return 1;
+	}
+
+	t0 = now_ns(CLOCK_MONOTONIC);
+	if (b.workload == W_REPLAY) {
+		ret = run_replay(&b) ? 1 : 0;
+		i = ret ? 0 : b.frames;
+	} else {
+		for (i = 0; i < b.frames; i++) {
+			uint64_t before = 0, ts = now_ns(CLOCK_MONOTONIC);
+			uint64_t cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+			struct stats st;
+
+			if (b.stats[0]) {
+				if (read_stats(&b, &st)) {
+					ret = 1;
+					break;
+				}
+				before = st.flushes;
+			}
+
+			if (submit(&b, i)) {
+				fprintf(stderr, "frame %d: %s\n", i,
+					strerror(errno));
+				ret = 1;
+				break;
+			}
+			b.cpu_ns += now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+
+			if (b.stats[0] && wait_flush(&b, before)) {
+				fprintf(stderr, "frame %d: no flush\n", i);
+				ret = 1;
+				break;
+			}
+			b.lat_ns[i] = now_ns(CLOCK_MONOTONIC) - ts;
+		}
+	}
+
+	if (i) {
+		if (b.stats[0])
+			read_stats(&b, &s1);
+		report(&b, i, now_ns(CLOCK_MONOTONIC) - t0,
+		       b.stats[0] ? &s0 : NULL, &s1);
+	}
+
+	if (b.path != P_SYSFS)
+		teardown_fb(&b);
+	free(b.lat_ns);
+	free(b.trace);
+	return ret;
+}
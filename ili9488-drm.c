@@ -0,0 +1,499 @@
+/*
+ * ili9488_drm.c - DRM driver for ILI9488 (3-bit mode, 8 colors)
+ *
+ * Interface: 3-line SPI, IM[2:0]=101, hardware 9-bit (bits_per_word=9)
+ * Colors:    8 (RGB 1-1-1), COLMOD=0x01
+ * Formats:   XRGB8888, RGB565 -> 3-bit (threshold at half scale)
+ *
+ * Same panel as ili9488_fb, but on the atomic KMS helpers:
+ *  - exact damage from FB_DAMAGE_CLIPS / DRM_IOCTL_MODE_DIRTYFB,
+ *    only the merged damage rectangle goes over SPI
+ *  - the plane update runs synchronously, and the (fake) vblank event
+ *    is sent by the commit tail after it returns, so out-fences
+ *    signal on SPI completion
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/spi/spi.h>
+#include <linux/of.h>
+#include <linux/property.h>
+#include <linux/gpio/consumer.h>
+#include <linux/delay.h>
+#include <linux/dma-buf-map.h>
+#include <linux/dma-direction.h>
+
+#include <drm/drm_atomic_helper.h>
+#include <drm/drm_connector.h>
+#include <drm/drm_damage_helper.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_fb_helper.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_gem_atomic_helper.h>
+#include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_gem_shmem_helper.h>
+#include <drm/drm_managed.h>
+#include <drm/drm_modes.h>
+#include <drm/drm_probe_helper.h>
+#include <drm/drm_rect.h>
+#include <drm/drm_simple_kms_helper.h>
+
+#define DRIVER_NAME   "ili9488_drm"
+
+#define FLUSH_CHUNK   2048      /* words per spi_sync (PL022 timeout) */
+
+struct ili9488_drm {
+	struct drm_device              drm;
+	struct drm_simple_display_pipe pipe;
+	struct drm_connector           connector;
+	struct spi_device             *spi;
+	struct gpio_desc              *reset;
+	struct gpio_desc              *bl;
+	u16                           *wire;     /* FLUSH_CHUNK 9-bit words */
+	u16                            cmd[11];  /* CASET + PASET + RAMWR */
+};
+
+static inline struct ili9488_drm *to_ili9488(struct drm_device *drm)
+{
+	return container_of(drm, struct ili9488_drm, drm);
+}
+
+static const struct drm_display_mode ili9488_mode = {
+	DRM_SIMPLE_MODE(320, 480, 49, 73),
+};
+
+static const u32 ili9488_formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_RGB565,
+};
+
+/* ---- SPI 9-bit helpers ---- */
+
+static int ili9488_send(struct ili9488_drm *lcd, const u16 *buf, int nwords)
+{
+	struct spi_transfer t = {
+		.tx_buf        = buf,
+		.len           = nwords * 2,
+		.bits_per_word = 9,
+	};
+	struct spi_message m;
+
+	spi_message_init(&m);
+	spi_message_add_tail(&t, &m);
+	return spi_sync(lcd->spi, &m);
+}
+
+static int ili9488_cmd(struct ili9488_drm *lcd, u8 cmd, const u8 *data,
+		       int len)
+{
+	int i;
+
+	lcd->cmd[0] = cmd;
+	for (i = 0; i < len; i++)
+		lcd->cmd[1 + i] = 0x100 | data[i];
+	return ili9488_send(lcd, lcd->cmd, 1 + len);
+}
+
+static int ili9488_set_window(struct ili9488_drm *lcd,
+			      const struct drm_rect *r)
+{
+	u16 x0 = r->x1, x1 = r->x2 - 1;
+	u16 y0 = r->y1, y1 = r->y2 - 1;
+	u16 *w = lcd->cmd;
+
+	w[0]  = 0x2A;
+	w[1]  = 0x100 | (x0 >> 8); w[2]  = 0x100 | (x0 & 0xFF);
+	w[3]  = 0x100 | (x1 >> 8); w[4]  = 0x100 | (x1 & 0xFF);
+	w[5]  = 0x2B;
+	w[6]  = 0x100 | (y0 >> 8); w[7]  = 0x100 | (y0 & 0xFF);
+	w[8]  = 0x100 | (y1 >> 8); w[9]  = 0x100 | (y1 & 0xFF);
+	w[10] = 0x2C; /* RAMWR */
+
+	return ili9488_send(lcd, w, 11);
+}
+
+/* ---- panel init ---- */
+
+static int ili9488_hw_init(struct ili9488_drm *lcd)
+{
+	static const u8 colmod = 0x01;  /* 3-bit */
+	static const u8 madctl = 0x48;  /* MX=1, BGR=1 */
+	int ret;
+
+	if (lcd->reset) {
+		gpiod_set_value_cansleep(lcd->reset, 0);
+		msleep(20);
+		gpiod_set_value_cansleep(lcd->reset, 1);
+		msleep(120);
+	}
+
+	ret = ili9488_cmd(lcd, 0x01, NULL, 0);   /* SWRESET */
+	if (ret)
+		return ret;
+	msleep(150);
+
+	ret = ili9488_cmd(lcd, 0x11, NULL, 0);   /* SLEEP OUT */
+	if (ret)
+		return ret;
+	msleep(120);
+
+	ret = ili9488_cmd(lcd, 0x3A, &colmod, 1);
+	if (ret)
+		return ret;
+
+	ret = ili9488_cmd(lcd, 0x36, &madctl, 1);
+	if (ret)
+		return ret;
+
+	ret = ili9488_cmd(lcd, 0x21, NULL, 0);   /* INVON */
+	if (ret)
+		return ret;
+
+	ret = ili9488_cmd(lcd, 0x13, NULL, 0);   /* NORON */
+	if (ret)
+		return ret;
+
+	return ili9488_cmd(lcd, 0x29, NULL, 0);  /* DISPON */
+}
+
+/* ---- conversion to 3-bit: bit2 = R, bit1 = G, bit0 = B ---- */
+
+static void ili9488_pack_xrgb8888(u16 *dst, const u32 *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		u32 p = src[i];
+
+		dst[i] = 0x100 | ((p >> 21) & 0x4) | ((p >> 14) & 0x2) |
+			 ((p >> 7) & 0x1);
+	}
+}
+
+static void ili9488_pack_rgb565(u16 *dst, const u16 *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		u16 p = src[i];
+
+		dst[i] = 0x100 | ((p >> 13) & 0x4) | ((p >> 9) & 0x2) |
+			 ((p >> 4) & 0x1);
+	}
+}
+
+/* ---- flush of one damage rectangle ---- */
+
+static int ili9488_fb_dirty(struct ili9488_drm *lcd,
+			    const struct dma_buf_map *map,
+			    struct drm_framebuffer *fb,
+			    const struct drm_rect *rect)
+{
+	const u8 *vaddr = map->vaddr;
+	unsigned int cpp = fb->format->cpp[0];
+	int width = drm_rect_width(rect);
+	int x = 0;
+	int y = rect->y1;
+	int ret;
+
+	/* shadow-plane может быть imported dma-buf: синхронизация кэшей */
+	ret = drm_gem_fb_begin_cpu_access(fb, DMA_FROM_DEVICE);
+	if (ret)
+		return ret;
+
+	ret = ili9488_set_window(lcd, rect);
+	if (ret)
+		goto out;
+
+	while (y < rect->y2) {
+		int n = 0;
+
+		while (n < FLUSH_CHUNK && y < rect->y2) {
+			const void *src = vaddr + y * fb->pitches[0] +
+					  (rect->x1 + x) * cpp;
+			int cnt = min(FLUSH_CHUNK - n, width - x);
+
+			if (fb->format->format == DRM_FORMAT_XRGB8888)
+				ili9488_pack_xrgb8888(lcd->wire + n, src, cnt);
+			else
+				ili9488_pack_rgb565(lcd->wire + n, src, cnt);
+
+			n += cnt;
+			x += cnt;
+			if (x == width) {
+				x = 0;
+				y++;
+			}
+		}
+
+		ret = ili9488_send(lcd, lcd->wire, n);
+		if (ret)
+			break;
+	}
+
+out:
+	drm_gem_fb_end_cpu_access(fb, DMA_FROM_DEVICE);
+	return ret;
+}
+
+/* ---- simple display pipe ---- */
+
+static enum drm_mode_status
+ili9488_pipe_mode_valid(struct drm_simple_display_pipe *pipe,
+			const struct drm_display_mode *mode)
+{
+	if (mode->hdisplay != ili9488_mode.hdisplay ||
+	    mode->vdisplay != ili9488_mode.vdisplay)
+		return MODE_BAD;
+	return MODE_OK;
+}
+
+static void ili9488_pipe_enable(struct drm_simple_display_pipe *pipe,
+				struct drm_crtc_state *crtc_state,
+				struct drm_plane_state *plane_state)
+{
+	struct ili9488_drm *lcd = to_ili9488(pipe->crtc.dev);
+	struct drm_shadow_plane_state *shadow =
+		to_drm_shadow_plane_state(plane_state);
+	struct drm_framebuffer *fb = plane_state->fb;
+	struct drm_rect full;
+	int idx, ret;
+
+	if (!drm_dev_enter(&lcd->drm, &idx))
+		return;
+
+	drm_rect_init(&full, 0, 0, fb->width, fb->height);
+
+	ret = ili9488_hw_init(lcd);
+	if (!ret)
+		ret = ili9488_fb_dirty(lcd, &shadow->map[0], fb, &full);
+	if (ret)
+		drm_err(&lcd->drm, "enable failed: %d\n", ret);
+
+	if (lcd->bl)
+		gpiod_set_value_cansleep(lcd->bl, 1);
+
+	drm_dev_exit(idx);
+}
+
+static void ili9488_pipe_disable(struct drm_simple_display_pipe *pipe)
+{
+	struct ili9488_drm *lcd = to_ili9488(pipe->crtc.dev);
+	int idx;
+
+	if (lcd->bl)
+		gpiod_set_value_cansleep(lcd->bl, 0);
+
+	if (!drm_dev_enter(&lcd->drm, &idx))
+		return;
+	ili9488_cmd(lcd, 0x28, NULL, 0);          /* DISPOFF */
+	drm_dev_exit(idx);
+}
+
+static void ili9488_pipe_update(struct drm_simple_display_pipe *pipe,
+				struct drm_plane_state *old_state)
+{
+	struct ili9488_drm *lcd = to_ili9488(pipe->crtc.dev);
+	struct drm_plane_state *state = pipe->plane.state;
+	struct drm_shadow_plane_state *shadow =
+		to_drm_shadow_plane_state(state);
+	struct drm_rect rect;
+	int idx, ret;
+
+	if (!pipe->crtc.state->active)
+		return;
+
+	if (!drm_atomic_helper_damage_merged(old_state, state, &rect))
+		return;
+
+	if (!drm_dev_enter(&lcd->drm, &idx))
+		return;
+
+	ret = ili9488_fb_dirty(lcd, &shadow->map[0], state->fb, &rect);
+	if (ret)
+		drm_err_once(&lcd->drm, "flush failed: %d\n", ret);
+
+	drm_dev_exit(idx);
+}
+
+static const struct drm_simple_display_pipe_funcs ili9488_pipe_funcs = {
+	.mode_valid = ili9488_pipe_mode_valid,
+	.enable     = ili9488_pipe_enable,
+	.disable    = ili9488_pipe_disable,
+	.update     = ili9488_pipe_update,
+	DRM_GEM_SIMPLE_DISPLAY_PIPE_SHADOW_PLANE_FUNCS,
+};
+
+/* ---- connector: one fixed mode ---- */
+
+static int ili9488_connector_get_modes(struct drm_connector *connector)
+{
+	struct drm_display_mode *mode;
+
+	mode = drm_mode_duplicate(connector->dev, &ili9488_mode);
+	if (!mode)
+		return 0;
+
+	drm_mode_set_name(mode);
+	mode->type |= DRM_MODE_TYPE_PREFERRED;
+	drm_mode_probed_add(connector, mode);
+
+	connector->display_info.width_mm  = mode->width_mm;
+	connector->display_info.height_mm = mode->height_mm;
+
+	return 1;
+}
+
+static const struct drm_connector_helper_funcs ili9488_connector_hfuncs = {
+	.get_modes = ili9488_connector_get_modes,
+};
+
+static const struct drm_connector_funcs ili9488_connector_funcs = {
+	.reset                  = drm_atomic_helper_connector_reset,
+	.fill_modes             = drm_helper_probe_single_connector_modes,
+	.destroy                = drm_connector_cleanup,
+	.atomic_duplicate_state = drm_atomic_helper_connector_duplicate_state,
+	.atomic_destroy_state   = drm_atomic_helper_connector_destroy_state,
+};
+
+/* ---- driver ---- */
+
+static const struct drm_mode_config_funcs ili9488_mode_config_funcs = {
+	.fb_create     = drm_gem_fb_create_with_dirty,
+	.atomic_check  = drm_atomic_helper_check,
+	.atomic_commit = drm_atomic_helper_commit,
+};
+
+DEFINE_DRM_GEM_FOPS(ili9488_fops);
+
+static const struct drm_driver ili9488_drm_driver = {
+	.driver_features = DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
+	.fops            = &ili9488_fops,
+	DRM_GEM_SHMEM_DRIVER_OPS,
+	.name            = "ili9488",
+	.desc            = "Ilitek ILI9488, 3-line SPI, 3-bit",
+	.date            = "20261018",
+	.major           = 1,
+	.minor           = 0,
+};
+
+static int ili9488_probe(struct spi_device *spi)
+{
+	struct device *dev = &spi->dev;
+	struct ili9488_drm *lcd;
+	struct drm_device *drm;
+	int ret;
+
+	lcd = devm_drm_dev_alloc(dev, &ili9488_drm_driver,
+				 struct ili9488_drm, drm);
+	if (IS_ERR(lcd))
+		return PTR_ERR(lcd);
+
+	drm = &lcd->drm;
+	lcd->spi = spi;
+
+	lcd->wire = devm_kmalloc_array(dev, FLUSH_CHUNK, sizeof(u16),
+				       GFP_KERNEL);
+	if (!lcd->wire)
+		return -ENOMEM;
+
+	lcd->reset = devm_gpiod_get_optional(dev, "reset", GPIOD_OUT_LOW);
+	if (IS_ERR(lcd->reset))
+		return dev_err_probe(dev, PTR_ERR(lcd->reset),
+				     "reset GPIO error\n");
+
+	lcd->bl = devm_gpiod_get_optional(dev, "backlight", GPIOD_OUT_LOW);
+	if (IS_ERR(lcd->bl))
+		return dev_err_probe(dev, PTR_ERR(lcd->bl),
+				     "backlight GPIO error\n");
+
+	spi->mode          = SPI_MODE_3;
+	spi->bits_per_word = 9;
+	if (!spi->max_speed_hz)
+		spi->max_speed_hz = 15000000;
+	ret = spi_setup(spi);
+	if (ret) {
+		dev_err(dev, "spi_setup failed: %d\n", ret);
+		return ret;
+	}
+
+	ret = drmm_mode_config_init(drm);
+	if (ret)
+		return ret;
+
+	drm->mode_config.min_width  = ili9488_mode.hdisplay;
+	drm->mode_config.max_width  = ili9488_mode.hdisplay;
+	drm->mode_config.min_height = ili9488_mode.vdisplay;
+	drm->mode_config.max_height = ili9488_mode.vdisplay;
+	drm->mode_config.funcs      = &ili9488_mode_config_funcs;
+
+	drm_connector_helper_add(&lcd->connector, &ili9488_connector_hfuncs);
+	ret = drm_connector_init(drm, &lcd->connector,
+				 &ili9488_connector_funcs,
+				 DRM_MODE_CONNECTOR_SPI);
+	if (ret)
+		return ret;
+
+	ret = drm_simple_display_pipe_init(drm, &lcd->pipe,
+					   &ili9488_pipe_funcs,
+					   ili9488_formats,
+					   ARRAY_SIZE(ili9488_formats),
+					   NULL, &lcd->connector);
+	if (ret)
+		return ret;
+
+	drm_plane_enable_fb_damage_clips(&lcd->pipe.plane);
+
+	drm_mode_config_reset(drm);
+
+	ret = drm_dev_register(drm, 0);
+	if (ret)
+		return ret;
+
+	spi_set_drvdata(spi, drm);
+
+	drm_fbdev_generic_setup(drm, 0);
+
+	dev_info(dev, "registered %s, %dx%d\n", drm->primary->name,
+		 ili9488_mode.hdisplay, ili9488_mode.vdisplay);
+
+	return 0;
+}
+
+static int ili9488_remove(struct spi_device *spi)
+{
+	struct drm_device *drm = spi_get_drvdata(spi);
+
+	drm_dev_unplug(drm);
+	drm_atomic_helper_shutdown(drm);
+
+	return 0;
+}
+
+static void ili9488_shutdown(struct spi_device *spi)
+{
+	drm_atomic_helper_shutdown(spi_get_drvdata(spi));
+}
+
+static const struct of_device_id ili9488_drm_of_match[] = {
+	{ .compatible = "ilitek,ili9488" },
+	{ },
+};
+MODULE_DEVICE_TABLE(of, ili9488_drm_of_match);
+
+static struct spi_driver ili9488_drm_spi_driver = {
+	.driver = {
+		.name           = DRIVER_NAME,
+		.of_match_table = ili9488_drm_of_match,
+	},
+	.probe    = ili9488_probe,
+	.remove   = ili9488_remove,
+	.shutdown = ili9488_shutdown,
+};
+
+module_spi_driver(ili9488_drm_spi_driver);
+
+MODULE_AUTHOR("tnv");
+MODULE_DESCRIPTION("ILI9488 DRM driver, 3-line SPI, 3-bit mode, 8 colors");
+MODULE_LICENSE("GPL");
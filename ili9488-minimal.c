@@ -6,6 +6,7 @@
  *
  * Extended with simple text-draw sysfs interface:
  *  - pixel, hline, vline, rect (fill/outline), fill
+ *  - chart / sample: strip chart on hardware vertical scroll
  *
  * Based on user's original test driver.
  */
@@ -43,6 +44,21 @@ struct ili9488 {
 	u8                 current_color;
 	u16                width;
 	u16                height;
+
+	/* panel window and write pointer as last programmed */
+	bool               win_valid;
+	u16                win_x0, win_x1;
+	u16                win_y0;	/* rows always run to height - 1 */
+	u16                ptr_x, ptr_y;
+
+	/* strip chart, see ili9488_chart_start() */
+	bool               chart_on;
+	u16                chart_top;
+	u16                chart_h;
+	u16                chart_head;	/* GRAM row the next sample goes to */
+	u8                 chart_bg;
+	int                chart_prev;	/* last sample value, -1 = none */
+	u16               *chart_row;	/* width words */
 };
 
 /* ---- helpers ---- */
@@ -88,26 +104,77 @@ static void ili9488_hw_reset(struct ili9488 *lcd)
 
 /* ---- basic commands ---- */
 
+/*
+ * Window cache: CASET / PASET are sent only when they change, and a
+ * draw that starts exactly at the write pointer inside the same columns
+ * goes out as a bare RAMWRC (0x3C). Rows are always programmed down to
+ * the bottom of the panel: a draw only sends its own pixels, so this
+ * is harmless, and stacked rows or rects in one column then continue
+ * without any address bytes.
+ */
 static int ili9488_set_window(struct ili9488 *lcd, u16 x0, u16 y0, u16 x1, u16 y1)
 {
-	u16 seq[12];
+	u16 seq[11];
 	int idx = 0;
-	/* CASE: send 2A (column), 2B (page), then 2C (memory write) */
-	seq[idx++] = W_CMD(0x2A);
-	seq[idx++] = W_DATA((x0 >> 8) & 0xFF);
-	seq[idx++] = W_DATA(x0 & 0xFF);
-	seq[idx++] = W_DATA((x1 >> 8) & 0xFF);
-	seq[idx++] = W_DATA(x1 & 0xFF);
-
-	seq[idx++] = W_CMD(0x2B);
-	seq[idx++] = W_DATA((y0 >> 8) & 0xFF);
-	seq[idx++] = W_DATA(y0 & 0xFF);
-	seq[idx++] = W_DATA((y1 >> 8) & 0xFF);
-	seq[idx++] = W_DATA(y1 & 0xFF);
+	int ret;
+
+	if (lcd->win_valid && x0 == lcd->win_x0 && x1 == lcd->win_x1 &&
+	    x0 == lcd->ptr_x && y0 == lcd->ptr_y) {
+		seq[idx++] = W_CMD(0x3C);
+		goto send;
+	}
+
+	if (!lcd->win_valid || x0 != lcd->win_x0 || x1 != lcd->win_x1) {
+		seq[idx++] = W_CMD(0x2A);
+		seq[idx++] = W_DATA((x0 >> 8) & 0xFF);
+		seq[idx++] = W_DATA(x0 & 0xFF);
+		seq[idx++] = W_DATA((x1 >> 8) & 0xFF);
+		seq[idx++] = W_DATA(x1 & 0xFF);
+	}
+
+	if (!lcd->win_valid || y0 != lcd->win_y0) {
+		seq[idx++] = W_CMD(0x2B);
+		seq[idx++] = W_DATA((y0 >> 8) & 0xFF);
+		seq[idx++] = W_DATA(y0 & 0xFF);
+		seq[idx++] = W_DATA(((lcd->height - 1) >> 8) & 0xFF);
+		seq[idx++] = W_DATA((lcd->height - 1) & 0xFF);
+	}
 
+	/* RAMWR restarts at the window origin */
 	seq[idx++] = W_CMD(0x2C);
 
-	return spi_send_words(lcd->spi, seq, idx);
+	lcd->win_x0 = x0;
+	lcd->win_x1 = x1;
+	lcd->win_y0 = y0;
+	lcd->ptr_x  = x0;
+	lcd->ptr_y  = y0;
+
+send:
+	ret = spi_send_words(lcd->spi, seq, idx);
+	lcd->win_valid = !ret;
+	return ret;
+}
+
+/* send pixel words and move the cached write pointer past them */
+static int ili9488_send_pixels(struct ili9488 *lcd, const u16 *buf, int n)
+{
+	u32 w = lcd->win_x1 - lcd->win_x0 + 1;
+	u32 off;
+	int ret;
+
+	ret = spi_send_words(lcd->spi, buf, n);
+	if (ret) {
+		lcd->win_valid = false;
+		return ret;
+	}
+
+	/* the panel wraps to the window origin after its last pixel */
+	off = (lcd->ptr_y - lcd->win_y0) * w + (lcd->ptr_x - lcd->win_x0) + n;
+	off %= w * (lcd->height - lcd->win_y0);
+	lcd->ptr_y = lcd->win_y0 + off / w;
+	lcd->ptr_x = lcd->win_x0 + off % w;
+
+	return 0;
 }
 
 /* send 'count' pixels with same 3-bit color */
@@ -127,7 +194,7 @@ static int ili9488_write_pixels_same(struct ili9488 *lcd, int count, u8 color)
 		int i;
 		for (i = 0; i < n; i++)
 			buf[i] = W_DATA(color);
-		ret = spi_send_words(lcd->spi, buf, n);
+		ret = ili9488_send_pixels(lcd, buf, n);
 		if (ret)
 			break;
 		sent += n;
@@ -241,6 +308,127 @@ static int ili9488_draw_rect(struct ili9488 *lcd, u16 x, u16 y, u16 w, u16 h, u8
 	}
 }
 
+/* ---- strip chart (hardware vertical scroll) ---- */
+
+/*
+ * GRAM rows top..top+h-1 become the scroll area (VSCRDEF). Each sample
+ * overwrites the oldest row and VSCRSADD makes the next-oldest row the
+ * first one shown, so the newest sample appears at the end of the area
+ * and one sample always costs one row of width pixels, whatever the
+ * chart length h.
+ *
+ * Scrolling runs along GRAM rows, so the time axis follows MADCTL: with
+ * 0x48 (portrait) the chart rolls up the screen; a panel mounted in
+ * landscape gets a right-to-left time axis for free.
+ * Other draw commands inside the area land on scrolled rows.
+ */
+static int ili9488_chart_scroll(struct ili9488 *lcd, u16 vsp)
+{
+	u16 seq[3];
+
+	seq[0] = W_CMD(0x37); /* VSCRSADD */
+	seq[1] = W_DATA(vsp >> 8);
+	seq[2] = W_DATA(vsp & 0xFF);
+
+	return spi_send_words(lcd->spi, seq, 3);
+}
+
+static int ili9488_chart_start(struct ili9488 *lcd, u16 top, u16 h, u8 bg)
+{
+	u16 bfa, seq[7];
+	int ret;
+
+	if (!h || top >= lcd->height || h > lcd->height - top)
+		return -EINVAL;
+
+	if (!lcd->chart_row) {
+		lcd->chart_row = kmalloc_array(lcd->width, sizeof(u16),
+					       GFP_KERNEL);
+		if (!lcd->chart_row)
+			return -ENOMEM;
+	}
+
+	bfa = lcd->height - top - h;
+	seq[0] = W_CMD(0x33); /* VSCRDEF */
+	seq[1] = W_DATA(top >> 8);
+	seq[2] = W_DATA(top & 0xFF);
+	seq[3] = W_DATA(h >> 8);
+	seq[4] = W_DATA(h & 0xFF);
+	seq[5] = W_DATA(bfa >> 8);
+	seq[6] = W_DATA(bfa & 0xFF);
+	ret = spi_send_words(lcd->spi, seq, 7);
+	if (ret)
+		return ret;
+
+	lcd->chart_top  = top;
+	lcd->chart_h    = h;
+	lcd->chart_head = top;
+	lcd->chart_bg   = bg;
+	lcd->chart_prev = -1;
+	lcd->chart_on   = true;
+
+	ret = ili9488_set_window(lcd, 0, top, lcd->width - 1, top + h - 1);
+	if (ret)
+		return ret;
+	ret = ili9488_write_pixels_same(lcd, (int)lcd->width * h, bg);
+	if (ret)
+		return ret;
+
+	return ili9488_chart_scroll(lcd, top);
+}
+
+static int ili9488_chart_stop(struct ili9488 *lcd)
+{
+	u16 seq[1];
+
+	if (!lcd->chart_on)
+		return 0;
+
+	lcd->chart_on = false;
+	kfree(lcd->chart_row);
+	lcd->chart_row = NULL;
+
+	seq[0] = W_CMD(0x13); /* NORON: leave scroll mode */
+	return spi_send_words(lcd->spi, seq, 1);
+}
+
+static int ili9488_chart_sample(struct ili9488 *lcd, u16 val, u8 color)
+{
+	int lo, hi, i, ret;
+
+	if (!lcd->chart_on)
+		return -EINVAL;
+
+	if (val >= lcd->width)
+		val = lcd->width - 1;
+
+	/* join to the previous sample so steep changes leave no gaps */
+	lo = val;
+	hi = val;
+	if (lcd->chart_prev >= 0) {
+		lo = min(lo, lcd->chart_prev);
+		hi = max(hi, lcd->chart_prev);
+	}
+	for (i = 0; i < lcd->width; i++)
+		lcd->chart_row[i] = W_DATA(i >= lo && i <= hi ?
+					   color : lcd->chart_bg);
+
+	ret = ili9488_set_window(lcd, 0, lcd->chart_head,
+				 lcd->width - 1, lcd->chart_head);
+	if (ret)
+		return ret;
+	ret = ili9488_send_pixels(lcd, lcd->chart_row, lcd->width);
+	if (ret)
+		return ret;
+
+	lcd->chart_prev = val;
+	lcd->chart_head = lcd->chart_top +
+			  (lcd->chart_head - lcd->chart_top + 1) % lcd->chart_h;
+
+	/* the row written next is the oldest: show it first */
+	return ili9488_chart_scroll(lcd, lcd->chart_head);
+}
+
 /* ---- sysfs parsing ---- */
 
 static int parse_u16(const char *s, u16 *out)
@@ -346,6 +534,26 @@ static ssize_t draw_store(struct device *dev,
 			fill = false;
 		else { ret = -EINVAL; goto out; }
 		ret = ili9488_draw_rect(lcd, x, y, w, h, c, fill);
+	} else if (strcmp(token, "chart") == 0) {
+		char *ts = strsep(&s, " \t\n");
+		char *hs = strsep(&s, " \t\n");
+		char *cs = strsep(&s, " \t\n");
+		u16 top,h; u8 c;
+		if (!ts) { ret = -EINVAL; goto out; }
+		if (strcmp(ts, "off") == 0) {
+			ret = ili9488_chart_stop(lcd);
+			goto out;
+		}
+		if (!hs || !cs) { ret = -EINVAL; goto out; }
+		if (parse_u16(ts, &top) || parse_u16(hs, &h) || parse_u8(cs, &c) || c > 7) { ret = -EINVAL; goto out; }
+		ret = ili9488_chart_start(lcd, top, h, c);
+	} else if (strcmp(token, "sample") == 0) {
+		char *vs = strsep(&s, " \t\n");
+		char *cs = strsep(&s, " \t\n");
+		u16 v; u8 c;
+		if (!vs || !cs) { ret = -EINVAL; goto out; }
+		if (parse_u16(vs, &v) || parse_u8(cs, &c) || c > 7) { ret = -EINVAL; goto out; }
+		ret = ili9488_chart_sample(lcd, v, c);
 	} else {
 		ret = -EINVAL;
 	}
@@ -431,8 +639,11 @@ static int ili9488_probe(struct spi_device *spi)
 
 static int ili9488_remove(struct spi_device *spi)
 {
+	struct ili9488 *lcd = spi_get_drvdata(spi);
+
 	device_remove_file(&spi->dev, &dev_attr_draw);
 	device_remove_file(&spi->dev, &dev_attr_color);
+	kfree(lcd->chart_row);
 	return 0;
 }
 
@@ -460,6 +671,7 @@ static int ili9488_init(struct ili9488 *lcd)
 	int ret;
 
 	ili9488_hw_reset(lcd);
+	lcd->win_valid = false;
 
 	seq[0] = W_CMD(0x01); /* SWRESET */
 	ret = spi_send_words(spi, seq, 1);
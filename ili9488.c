@@ -1,11 +1,15 @@
 /*
- * ili9488_fb.c - Framebuffer driver for ILI9488 (3-bit mode, 8 colors)
+ * ili9488_fb.c - Framebuffer driver for ILI9488 (3-bit or 18-bit mode)
  *
  * Interface: 3-line SPI, IM[2:0]=101, hardware 9-bit (bits_per_word=9)
- * Colors:    8 (RGB 1-1-1), COLMOD=0x01
- * Pixel:     1 byte per pixel, values 0x00-0x07
+ * Pixel:     1 byte per pixel in vmem, in both modes
  *
- * Color map:
+ * Colour modes (ILI9488_IOC_COLOR_MODE, runtime):
+ *   3-bit  - COLMOD=0x01, 8 colours (RGB 1-1-1), values 0x00-0x07,
+ *            one SPI word per pixel (default)
+ *   18-bit - COLMOD=0x66, vmem byte is RGB332, three SPI words per pixel
+ *
+ * 3-bit colour map:
  *   0x00 = BLACK    0x01 = BLUE     0x02 = GREEN   0x03 = CYAN
  *   0x04 = RED      0x05 = MAGENTA  0x06 = YELLOW  0x07 = WHITE
  */
@@ -15,218 +19,3772 @@
 #include <linux/fb.h>
 #include <linux/spi/spi.h>
 #include <linux/of.h>
+#include <linux/property.h>
 #include <linux/gpio/consumer.h>
 #include <linux/slab.h>
 #include <linux/delay.h>
 #include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/pm_qos.h>
+#include <linux/cpufreq.h>
+#include <linux/ktime.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include <linux/input.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
+#include <linux/font.h>
+#include <linux/hash.h>
+#include <linux/kref.h>
+#include <linux/pagemap.h>
+#include <linux/bitmap.h>
+
+#include "ili9488_fb.h"
+#include "ili9488_yuv.h"
 
 #define DRIVER_NAME  "ili9488_fb"
 
-#define LCD_WIDTH    320
-#define LCD_HEIGHT   480
-#define LCD_BPP      8
-#define LCD_BUFSIZE  (LCD_WIDTH * LCD_HEIGHT)   /* 153600 байт */
+#define LCD_WIDTH    320        /* по умолчанию, DT: width / height */
+#define LCD_HEIGHT   480
+#define LCD_BPP      8
+
+#define FLUSH_CHUNK  2048       /* пикселей за один spi_sync */
+#define DEFIO_DELAY  (HZ / 50) /* ~20ms между flush (50 fps max) */
+#define MAX_DAMAGE   8          /* прямоугольников в очереди на flush */
+#define MAX_OUTPUTS  2          /* панелей на один framebuffer (span) */
+#define MAX_MIRRORS  2          /* зеркал у первой панели (mirror) */
+#define MAX_PANELS   (MAX_OUTPUTS + MAX_MIRRORS)
+#define REGION_NONE  ILI9488_MAX_REGIONS  /* dirty_cls: вне регионов */
+#define PRIO_IDLE    0xFF       /* pending_prio: нового damage нет */
+#define FLUSH_RETRIES    3      /* повторов полосы после ошибки SPI */
+#define FLUSH_BACKOFF_US 200    /* пауза перед повтором, удваивается */
+#define REINIT_AFTER     3      /* сорванных flush подряд до переинициализации */
+#define MAX_SEGS     16         /* spi_transfer в одном сообщении flush */
+#define RUN_MIN      32         /* короче - упаковывается как есть */
+#define NUM_COLORS   8          /* 3 бита: цвета 0x00-0x07 */
+#define MAX_PACKERS  4          /* CPU на упаковку одного flush */
+#define SLPOUT_US    5000       /* после SLPOUT / SLPIN до следующей команды */
+#define SLPIN_HOLD_MS 120       /* после SLPOUT до SLPIN */
+
+/* состояние панели в простое, см. idle_sleep */
+enum ili9488_panel_state {
+	PANEL_ON,
+	PANEL_IDLE,                 /* IDMON: 8 цветов, GRAM на экране */
+	PANEL_SLEEP,                /* SLPIN, подсветка выключена */
+	PANEL_STATES,
+};
+
+static unsigned int trace_depth;
+module_param(trace_depth, uint, 0444);
+MODULE_PARM_DESC(trace_depth, "damage trace ring size in records (0 = off)");
+
+static bool input_latency;
+module_param(input_latency, bool, 0444);
+MODULE_PARM_DESC(input_latency, "measure key-press to flush-done latency");
+
+static unsigned int idle_ms = 10000;
+module_param(idle_ms, uint, 0644);
+MODULE_PARM_DESC(idle_ms, "release flush buffers after N ms without damage (0 = never)");
+
+static unsigned int idle_sleep;
+module_param(idle_sleep, uint, 0644);
+MODULE_PARM_DESC(idle_sleep, "panel after idle_ms without damage: 0 = on, 1 = IDMON, 2 = SLPIN + backlight off");
+
+static int flush_qos_us = -1;
+module_param(flush_qos_us, int, 0644);
+MODULE_PARM_DESC(flush_qos_us, "CPU wakeup latency limit in us held while a flush runs (-1 = none)");
+
+static unsigned int flush_min_khz;
+module_param(flush_min_khz, uint, 0644);
+MODULE_PARM_DESC(flush_min_khz, "cpufreq floor in kHz held while a flush runs (0 = none)");
+
+static unsigned int bus_slice_us;
+module_param(bus_slice_us, uint, 0644);
+MODULE_PARM_DESC(bus_slice_us, "max SPI bus time per flush message in us (0 = FLUSH_CHUNK words)");
+
+static bool gram_model;
+module_param(gram_model, bool, 0444);
+MODULE_PARM_DESC(gram_model, "decode the primary panel's bus stream into a software GRAM (debugfs gram)");
+
+static bool term;
+module_param(term, bool, 0444);
+MODULE_PARM_DESC(term, "create /dev/ili9488_termN, a text terminal on the panel (VGA8x16 font)");
+
+static bool pte_damage;
+module_param(pte_damage, bool, 0444);
+MODULE_PARM_DESC(pte_damage, "find mmap damage from PTE dirty bits instead of deferred IO write faults");
+
+static unsigned int pack_cpus;
+module_param(pack_cpus, uint, 0444);
+MODULE_PARM_DESC(pack_cpus, "CPUs packing one flush in parallel (0 = all online, 1 = inline)");
+
+static struct dentry *ili9488_debugfs_root;
+
+#define HUD_CHARS    6          /* символов в строке HUD */
+#define HUD_LINES    4
+#define HUD_W        (HUD_CHARS * 8 + 4)   /* 3x5 шрифт, масштаб 2 */
+#define HUD_H        (HUD_LINES * 12 + 4)
+#define HUD_X(par)   ((par)->width - HUD_W)   /* правый верхний угол */
+#define HUD_Y        0
+#define HUD_BOX      BIT(0)     /* режимы debugfs hud */
+#define HUD_OUTLINE  BIT(1)
+/* цвета HUD и рамок в формате текущего режима: 3 бита / RGB332 */
+#define HUD_BG(par)   ((par)->bpw > 1 ? 0x03 : 0x01)   /* синий */
+#define HUD_FG(par)   ((par)->bpw > 1 ? 0xFF : 0x07)   /* белый */
+#define HUD_LINE(par) ((par)->bpw > 1 ? 0xFC : 0x06)   /* жёлтый */
+
+#define LAT_BUCKET_MS  5        /* ширина корзины гистограммы латентности */
+#define LAT_BUCKETS    20       /* 0..100 ms, последняя - "и больше" */
+
+/* Прямоугольник, границы включительно */
+struct ili9488_rect {
+	u16 x0, y0, x1, y1;
+};
+
+/* кусок сообщения на шину: упакованные слова или заготовка одного цвета */
+struct ili9488_seg {
+	const u16 *buf;
+	int        n;
+};
+
+#define GRAM_W       320        /* GRAM панели, без поворота */
+#define GRAM_H       480
+
+/*
+ * Программная модель контроллера: разбирает поток 9-bit слов так же,
+ * как панель (см. "Модель панели"), и держит копию GRAM.
+ */
+struct ili9488_model {
+	u8   gram[GRAM_W * GRAM_H];  /* цвет 0-7 на пиксель */
+	u8   cmd;                    /* последняя команда */
+	int  narg;                   /* байт данных после неё */
+	u8   arg[4];
+	u16  sc, ec, sp, ep;         /* окно CASET / PASET */
+	u16  col, page;              /* указатель записи */
+	u8   madctl;
+	u8   colmod;
+	u8   px[3];                  /* накопление байт 18-bit пикселя */
+	int  npx;
+	u64  words;
+	u32  unknown;                /* команды, которые модель не знает */
+};
+
+#define TERM_CW      8          /* ячейка терминала, шрифт VGA8x16 */
+#define TERM_CH      16
+#define GLYPH_CACHE  64         /* глифов в кэше, степень двойки */
+
+struct ili9488_cell {
+	u8 ch, fg, bg;
+};
+
+/* глиф в готовом виде для шины: TERM_CH строк по TERM_CW слов */
+struct ili9488_glyph {
+	u32 key;                     /* ch | fg << 8 | bg << 16 | BIT(31) */
+	u16 words[TERM_CW * TERM_CH];
+};
+
+struct ili9488_term {
+	struct miscdevice        misc;
+	char                     name[24];
+	struct ili9488_par      *par;
+	const struct font_desc  *font;
+	int                      cols, rows;
+	int                      cx, cy;     /* курсор */
+	u8                       fg, bg;
+	int                      esc;        /* 0, 1 - ESC, 2 - ESC [ */
+	int                      arg[2];
+	int                      narg;
+	struct ili9488_cell     *cells;      /* cols * rows */
+	unsigned long           *dirty;      /* бит на ячейку: панель отстаёт */
+	struct ili9488_glyph     cache[GLYPH_CACHE];
+	u64                      cells_sent;
+	u64                      glyph_miss;
+};
+
+struct ili9488_par;
+
+/* упаковка одного блока на своём CPU, см. ili9488_send_rows_par() */
+struct ili9488_packer {
+	struct work_struct         work;
+	struct completion          done;
+	struct ili9488_par        *par;
+	const struct ili9488_rect *r;
+	int                        x, y;     /* начало блока */
+	bool                       outline;
+	u16                       *wire;     /* FLUSH_CHUNK слов */
+	struct ili9488_seg         seg[MAX_SEGS];
+	int                        nseg;
+	int                        n;
+};
+
+/* упаковка части прямоугольника в wire / seg, см. __ili9488_pack() */
+typedef int (*ili9488_pack_fn)(struct ili9488_par *par, u16 *wire,
+			       const struct ili9488_rect *r,
+			       int *px, int *py, bool outline,
+			       struct ili9488_seg *seg, int *nseg);
+
+/*
+ * Одна физическая панель. Обычно одна на framebuffer; в режиме span
+ * ("ilitek,span" в DT) framebuffer делится по столбцам между панелями
+ * на разных SPI-контроллерах, и каждая шлёт свою часть параллельно.
+ */
+struct ili9488_output {
+	struct spi_device  *spi;
+	struct gpio_desc   *reset_gpiod;
+	struct gpio_desc   *bl_gpiod;
+	u16                 x_off;       /* первый столбец vmem на панели */
+	u16                 width;       /* столбцов на панели */
+	u16                *wire;        /* FLUSH_CHUNK слов 9-bit, NULL в простое */
+	struct ili9488_packer *packers;  /* par->npackers, [0].wire == wire */
+	u16                 win_buf[11]; /* CASET + PASET + RAMWR */
+	u64                 bus_ns;      /* копится здесь, собирается в par */
+	u64                 wire_words;
+	u64                 hold_max_ns; /* самое долгое сообщение на шине */
+	u32                 retries;     /* повторы полос после ошибок SPI */
+	u64                 solid_words; /* ушло из заготовок par->solid */
+	u64                 last_end_ns; /* конец прошлого сообщения, 0 - нет */
+	u64                 gap_ns;      /* паузы между сообщениями */
+	u64                 gap_max_ns;
+	u32                 gaps;
+
+	/* flush вторичной панели в своём work, параллельно с первой */
+	struct ili9488_par *par;
+	struct work_struct  work;
+	struct completion   done;
+	const struct ili9488_rect *rects;
+	int                 nrects;
+	bool                outline;
+	int                 ret;
+	u16                 stop_y;      /* строка, на которой вытеснен */
+
+	/* зеркала получают тот же упакованный поток через spi_async */
+	struct ili9488_output *mirror[MAX_MIRRORS];
+	int                 nmirror;
+	struct spi_transfer xfers[MAX_SEGS]; /* сообщение этой панели */
+	struct spi_message  msg;
+	struct completion   xfer_done;
+	int                 xfer_ret;
+	u32                 errors;      /* ошибки SPI зеркала */
+
+	struct ili9488_model *model;     /* gram_model=1, только первая */
+
+	struct list_head    node;        /* ili9488_secondaries */
+};
+
+/* паузы между блоками flush, отдельно с QoS и без */
+struct ili9488_gap_stat {
+	u64 flushes;
+	u64 flush_ns;
+	u64 gaps;
+	u64 gap_ns;
+	u64 gap_max_ns;
+};
+
+/*
+ * vm_private_data отображения при pte_damage=1. Живёт, пока есть VMA
+ * или ссылка из par: VMA может пережить remove(). par обнуляется в
+ * remove() под lock, после этого close() par не трогает.
+ */
+struct ili9488_pte_map {
+	struct kref         kref;
+	spinlock_t          lock;
+	struct ili9488_par *par;
+};
+
+struct ili9488_par {
+	struct spi_device *spi;          /* первая панель, для логов */
+	struct fb_ops      fbops;        /* своя копия: fb_mmap по устройству */
+	struct fb_info    *info;
+	u8                *vmem;
+
+	struct ili9488_output  primary;
+	struct ili9488_output *out[MAX_OUTPUTS];    /* области vmem (span) */
+	int                    nout;
+	struct ili9488_output *panels[MAX_PANELS];  /* все, с зеркалами */
+	int                    npanels;
+
+	/* геометрия из DT; vmem - width * height байт, строка = width */
+	u16                width;
+	u16                height;
+	u32                vmem_size;
+	u8                 madctl;
+	ili9488_pack_fn    pack;         /* выбирается в probe */
+	int                chunk;        /* слов в сообщении, см. bus_slice_us */
+	u8                 colmod;       /* 0x01 - 3 бита, 0x66 - 18 бит */
+	int                bpw;          /* слов на пиксель: 1 или 3 */
+	u16                lut18[256][3];   /* RGB332 -> R, G, B для 0x66 */
+	int                npackers;     /* см. pack_cpus */
+
+	/* damage: накапливается под dirty_lock, забирается flush'ем */
+	spinlock_t          dirty_lock;
+	struct ili9488_rect dirty[MAX_DAMAGE];
+	u8                  dirty_cls[MAX_DAMAGE]; /* регион или REGION_NONE */
+	int                 ndirty;
+	u8                  pending_prio;  /* лучший приоритет нового damage */
+	u8                  flush_prio;    /* приоритет отправляемой группы */
+	struct delayed_work flush_work;  /* flush после fb_ops / write */
+	struct mutex        flush_lock;  /* один flush за раз */
+	bool                buffers;     /* wire выделены (не простой) */
+	u16                *solid[NUM_COLORS]; /* FLUSH_CHUNK слов 0x100|c */
+	struct delayed_work idle_work;   /* освобождение буферов в простое */
+
+	/* регионы обновления (ILI9488_IOC_REGION_SET), под dirty_lock */
+	struct ili9488_region_state {
+		struct ili9488_rect r;
+		bool                used;
+		u8                  prio;       /* ILI9488_PRIO_* */
+		u64                 period_ns;  /* 0 - без ограничения */
+		u64                 next_ns;    /* раньше не отправлять */
+	} regions[ILI9488_MAX_REGIONS];
+
+	/* трасса damage (trace_depth > 0) */
+	struct ili9488_trace_rec *trace;
+	unsigned int        trace_head;  /* следующая запись */
+	unsigned int        trace_len;   /* записей в буфере */
+	unsigned int        trace_lost;  /* перезаписано до чтения */
+	struct dentry      *debugfs;
+
+	/* латентность клавиша → экран (input_latency=1) */
+	u64                 input_seen_ns;  /* последнее учтённое событие */
+	u64                 dirty_input_ns; /* событие, вызвавшее damage */
+	u32                 lat_hist[LAT_BUCKETS];
+	u32                 lat_count;
+	u64                 lat_max_ns;
+	u64                 lat_sum_ns;
+
+	/* статистика flush, обновляется под flush_lock */
+	u64                 flushes;
+	u64                 flush_errors;   /* кадры, оборванные ошибкой SPI */
+	u32                 err_streak;     /* сорванных flush подряд */
+	u64                 retries;
+	u32                 reinits;        /* переинициализаций панелей */
+	u64                 wire_words;     /* 9-bit слов на шине */
+	u64                 bus_ns;         /* суммарно внутри spi_sync */
+	u64                 last_flush_ns;
+	u64                 win_start_ns;   /* окно 1 с для fps / загрузки */
+	u32                 win_flushes;
+	u64                 win_bus_ns;
+	u32                 fps;
+	u32                 bus_pct;
+	u32                 idle_releases;  /* сколько раз буферы отпускались */
+	u64                 wake_max_ns;    /* худшее время их возврата */
+	u8                  panel_state;    /* enum ili9488_panel_state */
+	u64                 panel_since_ns; /* вход в panel_state */
+	u64                 slpout_ns;      /* последний SLPOUT, для SLPIN_HOLD_MS */
+	u64                 panel_res_ns[PANEL_STATES];  /* время в состояниях */
+	u32                 panel_sleeps;
+	u64                 panel_wake_ns;  /* последнее пробуждение панели */
+	u64                 panel_wake_max_ns;
+
+	/* flush_qos_us / flush_min_khz: держатся только на время flush */
+	struct pm_qos_request   qos_req;
+	/* по одному на политику cpufreq онлайн-CPU; нет cpufreq - пусто */
+	struct freq_qos_request freq_req[MAX_PACKERS];
+	int                     nfreq;
+	bool                    qos_held;
+	struct ili9488_gap_stat gap_stat[2]; /* [qos_held] */
+	u64                 preempts;       /* flush прерван приоритетным */
+	u64                 hold_max_ns;    /* худшее удержание шины одним flush */
+	u64                 rate_held;      /* отложено ограничением частоты */
+	u64                 solid_words;    /* слов без упаковки (заготовки) */
+
+	/* debug HUD (debugfs hud), поверх потока на шину, vmem не трогает */
+	u32                 hud;            /* HUD_BOX | HUD_OUTLINE */
+	u8                 *hud_img;        /* HUD_W * HUD_H, цвета 0-7 */
+	bool                hud_restore;    /* следующий flush - без рамок */
+
+	/* слои поверх vmem (ILI9488_IOC_LAYER_*), меняются под flush_lock */
+	struct ili9488_layer {
+		u8                 *buf;     /* width * height, NULL - выключен */
+		u8                  key;     /* прозрачный цвет */
+		bool                used;    /* extent валиден */
+		struct ili9488_rect extent;  /* где вообще есть пиксели */
+	} layers[ILI9488_MAX_LAYERS];
+
+	/* спрайт над слоями (ILI9488_IOC_SPRITE_*) */
+	struct {
+		u8   img[ILI9488_SPRITE_MAX * ILI9488_SPRITE_MAX];
+		u8   mask[ILI9488_SPRITE_MAX * ILI9488_SPRITE_MAX / 8];
+		u16  w, h;
+		s16  x, y;          /* позиция, меняется под dirty_lock */
+		bool visible;
+		s16  fx, fy;        /* снимок позиции на время flush */
+		bool fvisible;
+	} sprite;
+
+	/* != 0 - при упаковке нужен проход ili9488_compose() */
+	u32                 compose;
+
+	/* текстовый терминал (term=1), под flush_lock */
+	struct ili9488_term *term;
+
+	/* pte_damage=1: единственное отображение vmem, под pte_lock */
+	spinlock_t          pte_lock;
+	struct file        *pte_file;    /* get_file, NULL - не отображено */
+	unsigned long       pte_start;   /* vm_start отображения */
+	struct ili9488_pte_map *pte_map; /* со своей ссылкой, пока pte_file */
+	unsigned long      *pte_bitmap;  /* страницы vmem, только в pte_work */
+	int                 pte_idle;    /* пустых сборов подряд, pte_work */
+	struct delayed_work pte_work;    /* сбор dirty-битов раз в DEFIO_DELAY */
+
+	/* mmap damage: deferred IO против dirty-битов, под flush_lock */
+	u64                 defio_faults;   /* страниц из page_mkwrite */
+	u64                 pte_scans;
+	u64                 pte_pages;      /* грязных страниц найдено */
+	u64                 pte_scan_ns;    /* CPU на сбор */
+
+	/* ILI9488_IOC_YUV_FRAME, под flush_lock */
+	u64                 yuv_frames;
+	u64                 yuv_ns;         /* CPU на преобразование */
+};
+
+/* ------------------------------------------------------------------ */
+/* Модель панели                                                        */
+/*                                                                      */
+/* Для сверки с эталонными картинками без железа: всё, что уходит на   */
+/* первую панель, разбирается здесь. CASET / PASET / RAMWR / RAMWRC     */
+/* (0x3C), автоинкремент внутри окна, MADCTL (MY, MX, MV) и COLMOD.    */
+/* COLMOD 0x01 - как панель на этой плате: байт на пиксель, цвет в    */
+/* битах 2..0. 0x66 / 0x06 - три байта R, G, B, берётся старший бит.   */
+/* ------------------------------------------------------------------ */
+
+static void ili9488_model_reset(struct ili9488_model *m)
+{
+	m->madctl = 0;
+	m->colmod = 0x06;
+	m->sc = 0;
+	m->ec = GRAM_W - 1;
+	m->sp = 0;
+	m->ep = GRAM_H - 1;
+	m->col  = 0;
+	m->page = 0;
+	m->npx  = 0;
+}
+
+/* логические (col, page) после MADCTL → адрес в GRAM */
+static void ili9488_model_put(struct ili9488_model *m, u8 color)
+{
+	bool mv = m->madctl & BIT(5);
+	int  lw = mv ? GRAM_H : GRAM_W;
+	int  lh = mv ? GRAM_W : GRAM_H;
+	int  x  = m->col;
+	int  y  = m->page;
+
+	if (x < lw && y < lh) {
+		if (m->madctl & BIT(6))
+			x = lw - 1 - x;
+		if (m->madctl & BIT(7))
+			y = lh - 1 - y;
+		if (mv)
+			swap(x, y);
+		m->gram[y * GRAM_W + x] = color & 0x07;
+	}
+
+	if (++m->col > m->ec) {
+		m->col = m->sc;
+		if (++m->page > m->ep)
+			m->page = m->sp;
+	}
+}
+
+static void ili9488_model_data(struct ili9488_model *m, u8 d)
+{
+	switch (m->cmd) {
+	case 0x2A: /* CASET */
+	case 0x2B: /* PASET */
+		if (m->narg < 4)
+			m->arg[m->narg] = d;
+		if (m->narg == 3) {
+			u16 s = (m->arg[0] << 8) | m->arg[1];
+			u16 e = (m->arg[2] << 8) | m->arg[3];
+
+			if (m->cmd == 0x2A) {
+				m->sc = s;
+				m->ec = e;
+			} else {
+				m->sp = s;
+				m->ep = e;
+			}
+		}
+		break;
+	case 0x36: /* MADCTL */
+		m->madctl = d;
+		break;
+	case 0x3A: /* COLMOD */
+		m->colmod = d;
+		break;
+	case 0x2C: /* RAMWR */
+	case 0x3C: /* RAMWRC */
+		if ((m->colmod & 0x07) == 0x01) {
+			ili9488_model_put(m, d);
+			break;
+		}
+		m->px[m->npx++] = d;
+		if (m->npx == 3) {
+			ili9488_model_put(m, (m->px[0] >> 7) << 2 |
+					     (m->px[1] >> 7) << 1 |
+					     (m->px[2] >> 7));
+			m->npx = 0;
+		}
+		break;
+	}
+	m->narg++;
+}
+
+static void ili9488_model_feed(struct ili9488_model *m, const u16 *w, int n)
+{
+	int i;
+
+	m->words += n;
+	for (i = 0; i < n; i++) {
+		if (w[i] & 0x100) {
+			ili9488_model_data(m, w[i]);
+			continue;
+		}
+
+		m->cmd  = w[i];
+		m->narg = 0;
+		m->npx  = 0;
+		switch (m->cmd) {
+		case 0x01: /* SWRESET */
+			ili9488_model_reset(m);
+			break;
+		case 0x2C: /* RAMWR: с начала окна */
+			m->col  = m->sc;
+			m->page = m->sp;
+			break;
+		case 0x2A: case 0x2B: case 0x3C: case 0x36: case 0x3A:
+		case 0x10: case 0x11: case 0x13: case 0x21: case 0x29:
+		case 0x38: case 0x39:
+			break;
+		default:
+			m->unknown++;
+			break;
+		}
+	}
+}
+
+/* debugfs gram: GRAM_W * GRAM_H байт, строки GRAM сверху вниз */
+static ssize_t ili9488_gram_read(struct file *file, char __user *ubuf,
+				 size_t count, loff_t *ppos)
+{
+	struct ili9488_par *par = file->private_data;
+	ssize_t ret;
+
+	mutex_lock(&par->flush_lock);
+	ret = simple_read_from_buffer(ubuf, count, ppos,
+				      par->primary.model->gram,
+				      sizeof(par->primary.model->gram));
+	mutex_unlock(&par->flush_lock);
+
+	return ret;
+}
+
+static const struct file_operations ili9488_gram_fops = {
+	.owner  = THIS_MODULE,
+	.open   = simple_open,
+	.read   = ili9488_gram_read,
+	.llseek = default_llseek,
+};
+
+/* ------------------------------------------------------------------ */
+/* SPI 9-bit helpers                                                   */
+/*                                                                      */
+/* 9-bit word: бит8 = D/C, биты7..0 = данные                         */
+/* D/C=0 → команда, D/C=1 → данные                                   */
+/* ------------------------------------------------------------------ */
+
+static int spi_9bit(struct ili9488_output *out, u16 word)
+{
+	struct spi_transfer t;
+	struct spi_message  m;
+
+	if (out->model)
+		ili9488_model_feed(out->model, &word, 1);
+
+	memset(&t, 0, sizeof(t));
+	t.tx_buf        = &word;
+	t.len           = 2;
+	t.bits_per_word = 9;
+
+	spi_message_init(&m);
+	spi_message_add_tail(&t, &m);
+	return spi_sync(out->spi, &m);
+}
+
+static inline int lcd_cmd(struct ili9488_output *out, u8 cmd)
+{
+	return spi_9bit(out, (u16)cmd);
+}
+
+static inline int lcd_data(struct ili9488_output *out, u8 data)
+{
+	return spi_9bit(out, 0x100 | (u16)data);
+}
+
+/*
+ * Отправить куски seg одним сообщением на панель out и все её зеркала.
+ * Зеркалам те же буферы уходят через spi_async (их контроллеры
+ * работают параллельно), затем ждём всех. У каждой панели свои
+ * spi_transfer: ядро пишет в них, общими они быть не могут.
+ * Ошибка зеркала считается, но кадр не срывает.
+ */
+static void ili9488_xfer_complete(void *context)
+{
+	complete(context);
+}
+
+static void ili9488_fill_msg(struct ili9488_output *out,
+			     const struct ili9488_seg *seg, int nseg)
+{
+	int i;
+
+	spi_message_init(&out->msg);
+	for (i = 0; i < nseg; i++) {
+		struct spi_transfer *t = &out->xfers[i];
+
+		memset(t, 0, sizeof(*t));
+		t->tx_buf        = seg[i].buf;
+		t->len           = seg[i].n * sizeof(u16);
+		t->bits_per_word = 9;
+		spi_message_add_tail(t, &out->msg);
+	}
+}
+
+static int ili9488_xfer_segs(struct ili9488_output *out,
+			     const struct ili9488_seg *seg, int nseg)
+{
+	int i, ret;
+
+	for (i = 0; i < out->nmirror; i++) {
+		struct ili9488_output *mo = out->mirror[i];
+
+		ili9488_fill_msg(mo, seg, nseg);
+		mo->msg.complete = ili9488_xfer_complete;
+		mo->msg.context  = &mo->xfer_done;
+
+		reinit_completion(&mo->xfer_done);
+		mo->xfer_ret = spi_async(mo->spi, &mo->msg);
+	}
+
+	if (out->model)
+		for (i = 0; i < nseg; i++)
+			ili9488_model_feed(out->model, seg[i].buf, seg[i].n);
+
+	ili9488_fill_msg(out, seg, nseg);
+	ret = spi_sync(out->spi, &out->msg);
+
+	for (i = 0; i < out->nmirror; i++) {
+		struct ili9488_output *mo = out->mirror[i];
+
+		if (!mo->xfer_ret) {
+			wait_for_completion(&mo->xfer_done);
+			mo->xfer_ret = mo->msg.status;
+		}
+		if (mo->xfer_ret) {
+			mo->errors++;
+			dev_err_ratelimited(&mo->spi->dev,
+					    "mirror: spi error %d\n",
+					    mo->xfer_ret);
+		}
+	}
+
+	return ret;
+}
+
+static int ili9488_xfer(struct ili9488_output *out, const u16 *buf, int n)
+{
+	struct ili9488_seg seg = { .buf = buf, .n = n };
+
+	return ili9488_xfer_segs(out, &seg, 1);
+}
+
+/* ------------------------------------------------------------------ */
+/* Hardware reset                                                       */
+/* ------------------------------------------------------------------ */
+
+static void ili9488_hw_reset(struct ili9488_output *out)
+{
+	if (!out->reset_gpiod)
+		return;
+
+	gpiod_set_value_cansleep(out->reset_gpiod, 0);
+	msleep(20);
+	gpiod_set_value_cansleep(out->reset_gpiod, 1);
+	msleep(120);
+}
+
+/* ------------------------------------------------------------------ */
+/* Display initialisation                                               */
+/* ------------------------------------------------------------------ */
+
+static void ili9488_init_display(struct ili9488_par *par,
+				 struct ili9488_output *out)
+{
+	ili9488_hw_reset(out);
+
+	lcd_cmd(out, 0x01); msleep(150); /* SWRESET   */
+	lcd_cmd(out, 0x11); msleep(120); /* SLEEP OUT */
+
+	lcd_cmd(out,  0x3A);             /* COLMOD: 3 или 18 бит */
+	lcd_data(out, par->colmod);
+	msleep(10);
+
+	lcd_cmd(out,  0x36);             /* MADCTL: поворот, BGR=1 */
+	lcd_data(out, par->madctl);
+	msleep(10);
+
+	lcd_cmd(out, 0x21); msleep(10);  /* INVON  */
+	lcd_cmd(out, 0x13); msleep(10);  /* NORON  */
+	lcd_cmd(out, 0x29); msleep(50);  /* DISPON */
+
+	dev_info(&out->spi->dev, "display init done\n");
+}
+
+/* ------------------------------------------------------------------ */
+/* Set GRAM write window + RAMWR                                        */
+/* ------------------------------------------------------------------ */
+
+static int ili9488_set_window(struct ili9488_output *out,
+			      u16 x0, u16 y0, u16 x1, u16 y1)
+{
+	u16 *w = out->win_buf;
+
+	/* одним сообщением: для мелких окон (спрайт) это основная цена */
+	w[0]  = 0x2A;
+	w[1]  = 0x100 | (x0 >> 8); w[2]  = 0x100 | (x0 & 0xFF);
+	w[3]  = 0x100 | (x1 >> 8); w[4]  = 0x100 | (x1 & 0xFF);
+
+	w[5]  = 0x2B;
+	w[6]  = 0x100 | (y0 >> 8); w[7]  = 0x100 | (y0 & 0xFF);
+	w[8]  = 0x100 | (y1 >> 8); w[9]  = 0x100 | (y1 & 0xFF);
+
+	w[10] = 0x2C; /* RAMWR */
+
+	return ili9488_xfer(out, w, ARRAY_SIZE(out->win_buf));
+}
+
+/* ------------------------------------------------------------------ */
+/* Трасса damage                                                        */
+/*                                                                      */
+/* Кольцевой буфер сырых событий (до слияния прямоугольников), чтобы   */
+/* политики flush можно было сравнивать офлайн на реальных UI.          */
+/* ------------------------------------------------------------------ */
+
+static u32 ili9488_rect_hash(struct ili9488_par *par,
+			     const struct ili9488_rect *r)
+{
+	u32 crc = ~0;
+	int y;
+
+	for (y = r->y0; y <= r->y1; y++)
+		crc = crc32_le(crc, par->vmem + y * par->width + r->x0,
+			       r->x1 - r->x0 + 1);
+	return ~crc;
+}
+
+/* под dirty_lock; hash посчитан заранее, без блокировки */
+static void ili9488_trace(struct ili9488_par *par,
+			  const struct ili9488_rect *r, int source, u32 hash)
+{
+	struct ili9488_trace_rec *rec;
+
+	if (!par->trace)
+		return;
+
+	rec = &par->trace[par->trace_head];
+	rec->ts_ns  = ktime_get_ns();
+	rec->hash   = hash;
+	rec->x0     = r->x0;
+	rec->y0     = r->y0;
+	rec->x1     = r->x1;
+	rec->y1     = r->y1;
+	rec->source = source;
+	memset(rec->pad, 0, sizeof(rec->pad));
+
+	par->trace_head = (par->trace_head + 1) % trace_depth;
+	if (par->trace_len < trace_depth)
+		par->trace_len++;
+	else
+		par->trace_lost++;
+}
+
+static ssize_t ili9488_trace_read(struct file *file, char __user *ubuf,
+				  size_t count, loff_t *ppos)
+{
+	struct ili9488_par       *par = file->private_data;
+	struct ili9488_trace_rec  rec;
+	unsigned long flags;
+	size_t done = 0;
+
+	while (count - done >= sizeof(rec)) {
+		spin_lock_irqsave(&par->dirty_lock, flags);
+		if (!par->trace_len) {
+			spin_unlock_irqrestore(&par->dirty_lock, flags);
+			break;
+		}
+		rec = par->trace[(par->trace_head + trace_depth -
+				  par->trace_len) % trace_depth];
+		par->trace_len--;
+		spin_unlock_irqrestore(&par->dirty_lock, flags);
+
+		if (copy_to_user(ubuf + done, &rec, sizeof(rec)))
+			return done ? done : -EFAULT;
+		done += sizeof(rec);
+	}
+
+	return done;
+}
+
+static const struct file_operations ili9488_trace_fops = {
+	.owner  = THIS_MODULE,
+	.open   = simple_open,
+	.read   = ili9488_trace_read,
+	.llseek = no_llseek,
+};
+
+/* ------------------------------------------------------------------ */
+/* Латентность ввод → фотон                                            */
+/*                                                                      */
+/* input handler запоминает время последнего нажатия любой клавиши     */
+/* (gpio-keys на PCA9554). Первый damage после нажатия помечается этим */
+/* временем, по завершении его flush латентность попадает в гистограмму.*/
+/* ------------------------------------------------------------------ */
+
+static atomic64_t ili9488_input_ns = ATOMIC64_INIT(0);
+
+static void ili9488_input_event(struct input_handle *handle,
+				unsigned int type, unsigned int code, int value)
+{
+	/* только нажатие, автоповтор и отпускание не интересны */
+	if (type == EV_KEY && value == 1)
+		atomic64_set(&ili9488_input_ns, ktime_get_ns());
+}
+
+static int ili9488_input_connect(struct input_handler *handler,
+				 struct input_dev *dev,
+				 const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int ret;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev     = dev;
+	handle->handler = handler;
+	handle->name    = DRIVER_NAME;
+
+	ret = input_register_handle(handle);
+	if (ret)
+		goto err_free;
+
+	ret = input_open_device(handle);
+	if (ret)
+		goto err_unregister;
+
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return ret;
+}
+
+static void ili9488_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id ili9488_input_ids[] = {
+	{
+		.flags  = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit  = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static struct input_handler ili9488_input_handler = {
+	.event      = ili9488_input_event,
+	.connect    = ili9488_input_connect,
+	.disconnect = ili9488_input_disconnect,
+	.name       = DRIVER_NAME,
+	.id_table   = ili9488_input_ids,
+};
+
+/* вызывается под dirty_lock */
+static void ili9488_input_tag(struct ili9488_par *par)
+{
+	u64 ts = atomic64_read(&ili9488_input_ns);
+
+	if (ts <= par->input_seen_ns)
+		return;
+
+	par->input_seen_ns = ts;
+	if (!par->dirty_input_ns)
+		par->dirty_input_ns = ts;
+}
+
+static void ili9488_input_done(struct ili9488_par *par, u64 input_ns)
+{
+	u64 lat = ktime_get_ns() - input_ns;
+	u32 b   = div_u64(lat, LAT_BUCKET_MS * NSEC_PER_MSEC);
+	unsigned long flags;
+
+	spin_lock_irqsave(&par->dirty_lock, flags);
+	par->lat_hist[min_t(u32, b, LAT_BUCKETS - 1)]++;
+	par->lat_count++;
+	par->lat_sum_ns += lat;
+	par->lat_max_ns  = max(par->lat_max_ns, lat);
+	spin_unlock_irqrestore(&par->dirty_lock, flags);
+}
+
+static int ili9488_latency_show(struct seq_file *m, void *v)
+{
+	struct ili9488_par *par = m->private;
+	u32 hist[LAT_BUCKETS];
+	u32 count;
+	u64 max_ns, sum_ns;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&par->dirty_lock, flags);
+	memcpy(hist, par->lat_hist, sizeof(hist));
+	count  = par->lat_count;
+	max_ns = par->lat_max_ns;
+	sum_ns = par->lat_sum_ns;
+	spin_unlock_irqrestore(&par->dirty_lock, flags);
+
+	seq_printf(m, "count: %u\n", count);
+	seq_printf(m, "avg_us: %llu\n",
+		   count ? div_u64(sum_ns, count) / NSEC_PER_USEC : 0);
+	seq_printf(m, "max_us: %llu\n", div_u64(max_ns, NSEC_PER_USEC));
+	for (i = 0; i < LAT_BUCKETS - 1; i++)
+		seq_printf(m, "%3d-%3d ms: %u\n", i * LAT_BUCKET_MS,
+			   (i + 1) * LAT_BUCKET_MS, hist[i]);
+	seq_printf(m, "%3d+    ms: %u\n", i * LAT_BUCKET_MS, hist[i]);
+
+	return 0;
+}
+
+static int ili9488_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ili9488_latency_show, inode->i_private);
+}
+
+/* любая запись сбрасывает гистограмму */
+static ssize_t ili9488_latency_write(struct file *file,
+				     const char __user *ubuf,
+				     size_t count, loff_t *ppos)
+{
+	struct seq_file    *m   = file->private_data;
+	struct ili9488_par *par = m->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&par->dirty_lock, flags);
+	memset(par->lat_hist, 0, sizeof(par->lat_hist));
+	par->lat_count  = 0;
+	par->lat_sum_ns = 0;
+	par->lat_max_ns = 0;
+	spin_unlock_irqrestore(&par->dirty_lock, flags);
+
+	return count;
+}
+
+static const struct file_operations ili9488_latency_fops = {
+	.owner   = THIS_MODULE,
+	.open    = ili9488_latency_open,
+	.read    = seq_read,
+	.write   = ili9488_latency_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/* ------------------------------------------------------------------ */
+/* Damage                                                               */
+/*                                                                      */
+/* Прямоугольники копятся в par->dirty[]. Пересекающиеся и соседние    */
+/* сливаются; при переполнении новый сливается с тем, чья площадь      */
+/* вырастет меньше всего. Прямоугольники разных регионов обновления    */
+/* сливаются только при переполнении, иначе шумный регион с низким     */
+/* приоритетом тянул бы за собой срочный.                               */
+/* ------------------------------------------------------------------ */
+
+static u32 rect_area(const struct ili9488_rect *r)
+{
+	return (u32)(r->x1 - r->x0 + 1) * (r->y1 - r->y0 + 1);
+}
+
+static void rect_union(struct ili9488_rect *dst,
+		       const struct ili9488_rect *r)
+{
+	dst->x0 = min(dst->x0, r->x0);
+	dst->y0 = min(dst->y0, r->y0);
+	dst->x1 = max(dst->x1, r->x1);
+	dst->y1 = max(dst->y1, r->y1);
+}
+
+static bool rect_touches(const struct ili9488_rect *a,
+			 const struct ili9488_rect *b)
+{
+	return a->x0 <= b->x1 + 1 && b->x0 <= a->x1 + 1 &&
+	       a->y0 <= b->y1 + 1 && b->y0 <= a->y1 + 1;
+}
+
+static bool rect_intersects(const struct ili9488_rect *a,
+			    const struct ili9488_rect *b)
+{
+	return a->x0 <= b->x1 && b->x0 <= a->x1 &&
+	       a->y0 <= b->y1 && b->y0 <= a->y1;
+}
+
+static bool rect_contains(const struct ili9488_rect *a,
+			  const struct ili9488_rect *b)
+{
+	return a->x0 <= b->x0 && b->x1 <= a->x1 &&
+	       a->y0 <= b->y0 && b->y1 <= a->y1;
+}
+
+/* под dirty_lock */
+static u8 ili9488_cls_prio(struct ili9488_par *par, int cls)
+{
+	if (cls == REGION_NONE || !par->regions[cls].used)
+		return ILI9488_PRIO_NORMAL;
+	return par->regions[cls].prio;
+}
+
+/*
+ * Регион с лучшим приоритетом, задетый r. Менее приоритетный, чем
+ * NORMAL, регион берётся, только если r целиком внутри него: полоса
+ * deferred IO через лог не должна ждать его ограничения частоты.
+ * Под dirty_lock.
+ */
+static int ili9488_classify(struct ili9488_par *par,
+			    const struct ili9488_rect *r)
+{
+	int cls = REGION_NONE;
+	int i;
+
+	for (i = 0; i < ILI9488_MAX_REGIONS; i++) {
+		const struct ili9488_region_state *rg = &par->regions[i];
+
+		if (!rg->used || !rect_intersects(&rg->r, r))
+			continue;
+		if (cls == REGION_NONE || rg->prio < par->regions[cls].prio)
+			cls = i;
+	}
+
+	if (cls != REGION_NONE &&
+	    par->regions[cls].prio > ILI9488_PRIO_NORMAL &&
+	    !rect_contains(&par->regions[cls].r, r))
+		cls = REGION_NONE;
+
+	return cls;
+}
+
+/* вызывается под dirty_lock */
+static void ili9488_add_rect(struct ili9488_par *par,
+			     const struct ili9488_rect *r, int cls)
+{
+	struct ili9488_rect u;
+	u32 best_grow = U32_MAX;
+	int best = 0;
+	int i;
+
+	for (i = 0; i < par->ndirty; i++) {
+		if (par->dirty_cls[i] == cls &&
+		    rect_touches(&par->dirty[i], r)) {
+			rect_union(&par->dirty[i], r);
+			return;
+		}
+	}
+
+	if (par->ndirty < MAX_DAMAGE) {
+		par->dirty_cls[par->ndirty] = cls;
+		par->dirty[par->ndirty++]   = *r;
+		return;
+	}
+
+	for (i = 0; i < par->ndirty; i++) {
+		u32 grow;
+
+		u = par->dirty[i];
+		rect_union(&u, r);
+		grow = rect_area(&u) - rect_area(&par->dirty[i]);
+		if (grow < best_grow) {
+			best_grow = grow;
+			best = i;
+		}
+	}
+	rect_union(&par->dirty[best], r);
+	if (ili9488_cls_prio(par, cls) <
+	    ili9488_cls_prio(par, par->dirty_cls[best]))
+		par->dirty_cls[best] = cls;
+}
+
+/*
+ * Отметить область как изменённую. Координаты обрезаются по экрану.
+ * Можно вызывать из любого контекста (fbcon зовёт fb_ops под spinlock).
+ * Возвращает приоритет damage (PRIO_IDLE, если область пуста).
+ */
+static int ili9488_damage(struct ili9488_par *par, int x, int y,
+			  int w, int h, int source)
+{
+	struct ili9488_rect r;
+	unsigned long flags;
+	u32 hash = 0;
+	int cls, prio;
+
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	w = min(w, par->width - x);
+	h = min(h, par->height - y);
+	if (w <= 0 || h <= 0)
+		return PRIO_IDLE;
+
+	r.x0 = x;
+	r.y0 = y;
+	r.x1 = x + w - 1;
+	r.y1 = y + h - 1;
+
+	/* crc по всему прямоугольнику - не с выключенными прерываниями */
+	if (par->trace)
+		hash = ili9488_rect_hash(par, &r);
+
+	spin_lock_irqsave(&par->dirty_lock, flags);
+	ili9488_trace(par, &r, source, hash);
+	if (input_latency)
+		ili9488_input_tag(par);
+	cls  = ili9488_classify(par, &r);
+	prio = ili9488_cls_prio(par, cls);
+	par->pending_prio = min_t(u8, par->pending_prio, prio);
+	ili9488_add_rect(par, &r, cls);
+	spin_unlock_irqrestore(&par->dirty_lock, flags);
+
+	return prio;
+}
+
+/* ------------------------------------------------------------------ */
+/* Debug HUD                                                            */
+/*                                                                      */
+/* Окошко fps / загрузка шины / время flush / сорванные кадры и        */
+/* (по желанию) рамки вокруг каждого отправленного прямоугольника.     */
+/* Накладывается на слова wire при упаковке, vmem не меняется.        */
+/* Выключенный HUD стоит одну проверку par->compose на отрезок строки.*/
+/* ------------------------------------------------------------------ */
+
+static const char hud_chars[] = " 0123456789BDFT%";
+
+/* шрифт 3x5, по строке на байт, бит2 - левый столбец */
+static const u8 hud_font[][5] = {
+	{ 0, 0, 0, 0, 0 },                                       /* ' ' */
+	{ 7, 5, 5, 5, 7 }, { 2, 6, 2, 2, 7 }, { 7, 1, 7, 4, 7 }, /* 0 1 2 */
+	{ 7, 1, 7, 1, 7 }, { 5, 5, 7, 1, 1 }, { 7, 4, 7, 1, 7 }, /* 3 4 5 */
+	{ 7, 4, 7, 5, 7 }, { 7, 1, 1, 2, 2 }, { 7, 5, 7, 5, 7 }, /* 6 7 8 */
+	{ 7, 5, 7, 1, 7 },                                       /* 9 */
+	{ 6, 5, 6, 5, 6 }, { 6, 5, 5, 5, 6 }, { 7, 4, 6, 4, 4 }, /* B D F */
+	{ 7, 2, 2, 2, 2 }, { 5, 1, 2, 4, 5 },                    /* T % */
+};
+
+static void ili9488_hud_text(u8 *img, int line, const char *str, u8 fg)
+{
+	int c, row, col;
+
+	for (c = 0; c < HUD_CHARS && str[c]; c++) {
+		const char *p = strchr(hud_chars, str[c]);
+		const u8   *g = hud_font[p ? p - hud_chars : 0];
+		int ox = 2 + c * 8;
+		int oy = 2 + line * 12;
+
+		for (row = 0; row < 10; row++)
+			for (col = 0; col < 6; col++)
+				if (g[row / 2] & (4 >> (col / 2)))
+					img[(oy + row) * HUD_W + ox + col] = fg;
+	}
+}
+
+/* перерисовать HUD по текущей статистике; под flush_lock */
+static void ili9488_hud_render(struct ili9488_par *par)
+{
+	u8  *img = par->hud_img;
+	u8   fg  = HUD_FG(par);
+	char str[HUD_CHARS + 1];
+
+	memset(img, HUD_BG(par), HUD_W * HUD_H);
+
+	snprintf(str, sizeof(str), "F%5u", min_t(u32, par->fps, 99999));
+	ili9488_hud_text(img, 0, str, fg);
+	snprintf(str, sizeof(str), "B%4u%%", min_t(u32, par->bus_pct, 100));
+	ili9488_hud_text(img, 1, str, fg);
+	snprintf(str, sizeof(str), "T%5llu",
+		 min_t(u64, div_u64(par->last_flush_ns, NSEC_PER_MSEC), 99999));
+	ili9488_hud_text(img, 2, str, fg);
+	snprintf(str, sizeof(str), "D%5llu",
+		 min_t(u64, par->flush_errors, 99999));
+	ili9488_hud_text(img, 3, str, fg);
+}
+
+/*
+ * Наложить HUD на cnt слов строки y, начиная со столбца x.
+ * r - отправляемый прямоугольник (для рамки).
+ */
+static void ili9488_hud_overlay(struct ili9488_par *par, u16 *wire,
+				const struct ili9488_rect *r,
+				int x, int y, int cnt, bool outline)
+{
+	u16 line = 0x100 | HUD_LINE(par);
+	int i;
+
+	if (outline) {
+		if (y == r->y0 || y == r->y1) {
+			for (i = 0; i < cnt; i++)
+				wire[i] = line;
+		} else {
+			if (x == r->x0)
+				wire[0] = line;
+			if (x + cnt - 1 == r->x1)
+				wire[cnt - 1] = line;
+		}
+	}
+
+	if ((par->hud & HUD_BOX) &&
+	    y >= HUD_Y && y < HUD_Y + HUD_H &&
+	    x + cnt > HUD_X(par) && x < HUD_X(par) + HUD_W) {
+		int from = max(x, HUD_X(par));
+		int to   = min(x + cnt, HUD_X(par) + HUD_W);
+		const u8 *src = par->hud_img + (y - HUD_Y) * HUD_W - HUD_X(par);
+
+		for (i = from; i < to; i++)
+			wire[i - x] = 0x100 | src[i];
+	}
+}
+
+/* ------------------------------------------------------------------ */
+/* Слои                                                                 */
+/*                                                                      */
+/* Над vmem лежат до ILI9488_MAX_LAYERS слоёв размера экрана с цветовым */
+/* ключом. Слои смешиваются прямо в поток на шину при упаковке и только */
+/* в отправляемых пикселях, так что смена попапа не требует от         */
+/* приложения перерисовки фона в vmem.                                 */
+/* ------------------------------------------------------------------ */
+
+static void ili9488_update_compose(struct ili9488_par *par)
+{
+	int i;
+
+	par->compose = par->hud || par->sprite.w;
+	for (i = 0; i < ILI9488_MAX_LAYERS; i++)
+		if (par->layers[i].buf)
+			par->compose = 1;
+}
+
+static void ili9488_layers_compose(struct ili9488_par *par, u16 *wire,
+				   int x, int y, int cnt)
+{
+	int l, i;
+
+	for (l = 0; l < ILI9488_MAX_LAYERS; l++) {
+		const struct ili9488_layer *layer = &par->layers[l];
+		const u8 *src;
+		int from, to;
+
+		if (!layer->buf || !layer->used ||
+		    y < layer->extent.y0 || y > layer->extent.y1)
+			continue;
+
+		from = max(x, (int)layer->extent.x0);
+		to   = min(x + cnt - 1, (int)layer->extent.x1);
+		src  = layer->buf + y * par->width;
+
+		for (i = from; i <= to; i++)
+			if (src[i] != layer->key)
+				wire[i - x] = 0x100 | src[i];
+	}
+}
+
+/* ------------------------------------------------------------------ */
+/* Спрайт / курсор                                                      */
+/*                                                                      */
+/* До ILI9488_SPRITE_MAX x ILI9488_SPRITE_MAX с 1-битной маской.       */
+/* Перемещение отмечает только старый и новый прямоугольники, vmem и  */
+/* слои не трогаются. Пока картинка загружена, par->compose != 0.      */
+/* ------------------------------------------------------------------ */
+
+static void ili9488_sprite_compose(struct ili9488_par *par, u16 *wire,
+				   int x, int y, int cnt)
+{
+	int sy = y - par->sprite.fy;
+	int from, to, i;
+	const u8 *img, *mask;
+
+	if (sy < 0 || sy >= par->sprite.h)
+		return;
+
+	from = max(x, (int)par->sprite.fx);
+	to   = min(x + cnt, par->sprite.fx + par->sprite.w);
+	img  = par->sprite.img  + sy * par->sprite.w - par->sprite.fx;
+	mask = par->sprite.mask + sy * DIV_ROUND_UP(par->sprite.w, 8);
+
+	for (i = from; i < to; i++) {
+		int sx = i - par->sprite.fx;
+
+		if (mask[sx / 8] & (0x80 >> (sx % 8)))
+			wire[i - x] = 0x100 | img[i];
+	}
+}
+
+/* слои, спрайт, затем HUD поверх всего */
+static void ili9488_compose(struct ili9488_par *par, u16 *wire,
+			    const struct ili9488_rect *r,
+			    int x, int y, int cnt, bool outline)
+{
+	ili9488_layers_compose(par, wire, x, y, cnt);
+	if (par->sprite.fvisible)
+		ili9488_sprite_compose(par, wire, x, y, cnt);
+	if (par->hud)
+		ili9488_hud_overlay(par, wire, r, x, y, cnt, outline);
+}
+
+/* ------------------------------------------------------------------ */
+/* Flush: отправка damage на дисплей                                   */
+/*                                                                      */
+/* Каждый байт vmem (0x00-0x07) → 9-bit SPI слово: 0x100 | byte      */
+/* FLUSH_CHUNK пикселей за один spi_sync (избегаем таймаут PL022)     */
+/* Одноцветные отрезки берутся из заготовок par->solid без упаковки.  */
+/* ------------------------------------------------------------------ */
+
+/* отрезок из заготовки par->solid, а не из буфера упаковщика */
+static bool ili9488_seg_solid(const struct ili9488_par *par,
+			      const struct ili9488_seg *seg)
+{
+	int c;
+
+	for (c = 0; c < NUM_COLORS; c++)
+		if (seg->buf >= par->solid[c] &&
+		    seg->buf < par->solid[c] + FLUSH_CHUNK)
+			return true;
+	return false;
+}
+
+static int ili9488_send_wire(struct ili9488_output *out,
+			     const struct ili9488_seg *seg, int nseg, int n)
+{
+	u64 t0, dt;
+	int i, ret;
+
+	t0  = ktime_get_ns();
+	if (out->last_end_ns) {
+		dt = t0 - out->last_end_ns;
+		out->gap_ns    += dt;
+		out->gap_max_ns = max(out->gap_max_ns, dt);
+		out->gaps++;
+	}
+	ret = ili9488_xfer_segs(out, seg, nseg);
+	out->last_end_ns = ktime_get_ns();
+	dt  = out->last_end_ns - t0;
+	out->bus_ns     += dt;
+	out->wire_words += n;
+	out->hold_max_ns = max(out->hold_max_ns, dt);
+
+	for (i = 0; i < nseg; i++)
+		if (ili9488_seg_solid(out->par, &seg[i]))
+			out->solid_words += seg[i].n;
+
+	return ret;
+}
+
+/*
+ * Слов в одном сообщении flush. Между сообщениями контроллер берёт
+ * из очереди сообщения других устройств на той же шине, так что
+ * bus_slice_us ограничивает, сколько они ждут за кадром.
+ * 9 бит на слово при max_speed_hz первой панели.
+ */
+static int ili9488_slice_words(struct ili9488_par *par)
+{
+	u64 words;
+
+	if (!bus_slice_us)
+		return FLUSH_CHUNK;
+
+	words = div_u64((u64)bus_slice_us * par->spi->max_speed_hz,
+			9 * USEC_PER_SEC);
+	return clamp_t(u64, words, 16, FLUSH_CHUNK);
+}
+
+/* ------------------------------------------------------------------ */
+/* Буферы flush в простое                                               */
+/*                                                                      */
+/* Всё, что нужно только во время flush, берётся здесь и отдаётся      */
+/* обратно после idle_ms без damage. Содержимое заново строится из     */
+/* vmem, так что сохранять (сжимать) его не нужно - достаточно free.   */
+/* vmem остаётся: он отображён в userspace.                            */
+/* ------------------------------------------------------------------ */
+
+/* под flush_lock */
+static void ili9488_put_buffers(struct ili9488_par *par)
+{
+	int i, j;
+
+	for (i = 0; i < par->nout; i++) {
+		struct ili9488_output *out = par->out[i];
+
+		if (out->packers)
+			for (j = 1; j < par->npackers; j++)
+				kfree(out->packers[j].wire);
+		kfree(out->packers);
+		out->packers = NULL;
+		kfree(out->wire);
+		out->wire = NULL;
+	}
+	for (i = 0; i < NUM_COLORS; i++) {
+		kfree(par->solid[i]);
+		par->solid[i] = NULL;
+	}
+	par->buffers = false;
+}
+
+static void ili9488_packer_work(struct work_struct *work);
+
+/* упаковщики панели: [0] - сам flush со своим out->wire */
+static int ili9488_get_packers(struct ili9488_par *par,
+			       struct ili9488_output *out)
+{
+	int j;
+
+	if (par->npackers < 2)
+		return 0;
+
+	out->packers = kcalloc(par->npackers, sizeof(*out->packers),
+			       GFP_KERNEL);
+	if (!out->packers)
+		return -ENOMEM;
+
+	for (j = 0; j < par->npackers; j++) {
+		struct ili9488_packer *pk = &out->packers[j];
+
+		INIT_WORK(&pk->work, ili9488_packer_work);
+		init_completion(&pk->done);
+		pk->par  = par;
+		pk->wire = j ? kmalloc_array(FLUSH_CHUNK, sizeof(u16),
+					     GFP_KERNEL) : out->wire;
+		if (!pk->wire)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* под flush_lock */
+static int ili9488_get_buffers(struct ili9488_par *par)
+{
+	u64 t0;
+	int i, j;
+
+	if (par->buffers)
+		return 0;
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < par->nout; i++) {
+		par->out[i]->wire = kmalloc_array(FLUSH_CHUNK, sizeof(u16),
+						  GFP_KERNEL);
+		if (!par->out[i]->wire) {
+			ili9488_put_buffers(par);
+			return -ENOMEM;
+		}
+		if (ili9488_get_packers(par, par->out[i])) {
+			ili9488_put_buffers(par);
+			return -ENOMEM;
+		}
+	}
+	for (i = 0; i < NUM_COLORS; i++) {
+		par->solid[i] = kmalloc_array(FLUSH_CHUNK, sizeof(u16),
+					      GFP_KERNEL);
+		if (!par->solid[i]) {
+			ili9488_put_buffers(par);
+			return -ENOMEM;
+		}
+		for (j = 0; j < FLUSH_CHUNK; j++)
+			par->solid[i][j] = 0x100 | i;
+	}
+	par->buffers = true;
+	par->wake_max_ns = max(par->wake_max_ns, ktime_get_ns() - t0);
+
+	return 0;
+}
+
+/*
+ * Простой панели (idle_sleep): IDMON оставляет картинку (в 3-битном
+ * режиме без потерь), SLPIN гасит развёртку и подсветку. GRAM
+ * сохраняется в обоих, так что после пробуждения уходит только новый
+ * damage. Задержки - минимальные по datasheet: 5 мс после SLPIN /
+ * SLPOUT до следующей команды, 120 мс от SLPOUT до SLPIN. Всё под
+ * flush_lock.
+ */
+static void ili9488_panel_set(struct ili9488_par *par, u8 state)
+{
+	u64 now = ktime_get_ns();
+
+	par->panel_res_ns[par->panel_state] += now - par->panel_since_ns;
+	par->panel_state    = state;
+	par->panel_since_ns = now;
+}
+
+static void ili9488_panel_sleep(struct ili9488_par *par)
+{
+	u64 since = ktime_get_ns() - par->slpout_ns;
+	int i;
+
+	if (!idle_sleep || par->panel_state != PANEL_ON)
+		return;
+
+	if (idle_sleep == 1) {
+		for (i = 0; i < par->npanels; i++)
+			lcd_cmd(par->panels[i], 0x39);       /* IDMON */
+		ili9488_panel_set(par, PANEL_IDLE);
+	} else if (since < SLPIN_HOLD_MS * NSEC_PER_MSEC) {
+		mod_delayed_work(system_wq, &par->idle_work,
+				 nsecs_to_jiffies(SLPIN_HOLD_MS *
+						  NSEC_PER_MSEC - since) + 1);
+		return;
+	} else {
+		for (i = 0; i < par->npanels; i++) {
+			if (par->panels[i]->bl_gpiod)
+				gpiod_set_value_cansleep(par->panels[i]->bl_gpiod,
+							 0);
+			lcd_cmd(par->panels[i], 0x10);       /* SLPIN */
+		}
+		ili9488_panel_set(par, PANEL_SLEEP);
+	}
+	par->panel_sleeps++;
+}
+
+/* перед первой отправкой после простоя */
+static void ili9488_panel_wake(struct ili9488_par *par)
+{
+	u64 t0 = ktime_get_ns();
+	u64 since;
+	int i;
+
+	switch (par->panel_state) {
+	case PANEL_ON:
+		return;
+	case PANEL_IDLE:
+		for (i = 0; i < par->npanels; i++)
+			lcd_cmd(par->panels[i], 0x38);       /* IDMOFF */
+		break;
+	case PANEL_SLEEP:
+		since = t0 - par->panel_since_ns;
+		if (since < SLPOUT_US * NSEC_PER_USEC)
+			usleep_range(SLPOUT_US - div_u64(since, NSEC_PER_USEC),
+				     SLPOUT_US);
+		for (i = 0; i < par->npanels; i++)
+			lcd_cmd(par->panels[i], 0x11);       /* SLPOUT */
+		usleep_range(SLPOUT_US, SLPOUT_US + 500);
+		par->slpout_ns = ktime_get_ns();
+		for (i = 0; i < par->npanels; i++)
+			if (par->panels[i]->bl_gpiod)
+				gpiod_set_value_cansleep(par->panels[i]->bl_gpiod,
+							 1);
+		break;
+	}
+	ili9488_panel_set(par, PANEL_ON);
+	par->panel_wake_ns     = ktime_get_ns() - t0;
+	par->panel_wake_max_ns = max(par->panel_wake_max_ns,
+				     par->panel_wake_ns);
+}
+
+static void ili9488_idle_work(struct work_struct *work)
+{
+	struct ili9488_par *par = container_of(to_delayed_work(work),
+					       struct ili9488_par, idle_work);
+
+	mutex_lock(&par->flush_lock);
+	if (par->buffers) {
+		ili9488_put_buffers(par);
+		par->idle_releases++;
+	}
+	ili9488_panel_sleep(par);
+	mutex_unlock(&par->flush_lock);
+}
+
+/* ------------------------------------------------------------------ */
+/* Упаковка                                                             */
+/*                                                                      */
+/* Горячий цикл генерируется под константную ширину строки, чтобы     */
+/* y * width и ветка "полная ширина" сворачивались компилятором.       */
+/* Специализации: 320 (портрет), 480 (ландшафт), 640 (span 2 x 320),  */
+/* остальное - общий вариант. Поворот делает сама панель (MADCTL),     */
+/* масштабирования нет. Формат (3 / 18 бит) - ветка внутри по          */
+/* par->bpw: в 18-битном режиме слово на пиксель раскрывается в три.   */
+/* ------------------------------------------------------------------ */
+
+static inline void ili9488_pack_px(u16 *dst, const u8 *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = 0x100 | src[i];
+}
+
+/* COLMOD 0x66: байт RGB332 -> три слова R, G, B */
+static inline void ili9488_pack_px18(const struct ili9488_par *par,
+				     u16 *dst, const u8 *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++, dst += 3) {
+		const u16 *c = par->lut18[src[i]];
+
+		dst[0] = c[0];
+		dst[1] = c[1];
+		dst[2] = c[2];
+	}
+}
+
+/* n слов 0x100|byte после compose -> 3n слов на месте, с конца */
+static inline void ili9488_expand18(const struct ili9488_par *par,
+				    u16 *wire, int n)
+{
+	int i;
+
+	for (i = n - 1; i >= 0; i--) {
+		const u16 *c = par->lut18[wire[i] & 0xFF];
+
+		wire[3 * i]     = c[0];
+		wire[3 * i + 1] = c[1];
+		wire[3 * i + 2] = c[2];
+	}
+}
+
+/* добавить n слов из wire + *lit к последнему куску или новым */
+static inline void ili9488_seg_lit(u16 *wire, int *lit, int n,
+				   struct ili9488_seg *seg, int *nseg)
+{
+	if (*nseg && seg[*nseg - 1].buf + seg[*nseg - 1].n == wire + *lit)
+		seg[*nseg - 1].n += n;
+	else
+		seg[(*nseg)++] = (struct ili9488_seg){ wire + *lit, n };
+	*lit += n;
+}
+
+/*
+ * Одноцветные отрезки от RUN_MIN пикселей не упаковываются: кусок
+ * сообщения указывает на заготовку par->solid[c]. Поиск конца отрезка
+ * - memchr_inv (по словам), после короткого отрезка следующие RUN_MIN
+ * пикселей пакуются без поиска, так что на пёстрой картинке лишнего
+ * не больше одного вызова на RUN_MIN пикселей. Когда остаётся один
+ * свободный seg, остаток пакуется целиком: разложены всегда все len
+ * пикселей, и границы блоков зависят только от par->chunk.
+ */
+static int ili9488_pack_runs(struct ili9488_par *par, u16 *wire, int *lit,
+			     const u8 *src, int len,
+			     struct ili9488_seg *seg, int *nseg)
+{
+	int done = 0;
+
+	/* 18 бит: заготовок нет, всё литералом */
+	if (par->bpw > 1) {
+		ili9488_pack_px18(par, wire + *lit, src, len);
+		ili9488_seg_lit(wire, lit, len * par->bpw, seg, nseg);
+		return len;
+	}
+
+	while (done < len) {
+		u8 c = src[done];
+		const u8 *end = memchr_inv(src + done, c, len - done);
+		int run = end ? end - (src + done) : len - done;
+
+		if (*nseg >= MAX_SEGS - 1) {
+			run = len - done;
+			ili9488_pack_px(wire + *lit, src + done, run);
+			ili9488_seg_lit(wire, lit, run, seg, nseg);
+		} else if (run >= RUN_MIN && c < NUM_COLORS) {
+			seg[(*nseg)++] = (struct ili9488_seg){ par->solid[c], run };
+		} else {
+			run = min(max(run, RUN_MIN), len - done);
+			ili9488_pack_px(wire + *lit, src + done, run);
+			ili9488_seg_lit(wire, lit, run, seg, nseg);
+		}
+		done += run;
+	}
+
+	return done;
+}
+
+/*
+ * Разложить пиксели прямоугольника r начиная с (*px, *py) в куски seg,
+ * не больше par->chunk слов (par->chunk / par->bpw пикселей).
+ * Возвращает число слов, двигает *px / *py.
+ */
+static __always_inline int __ili9488_pack(struct ili9488_par *par,
+					  u16 *wire,
+					  const struct ili9488_rect *r,
+					  int *px, int *py, bool outline,
+					  struct ili9488_seg *seg, int *nseg,
+					  const int width)
+{
+	const u8 *vmem  = par->vmem;
+	const int chunk = par->chunk / par->bpw;
+	int x = *px;
+	int y = *py;
+	int n = 0, lit = 0;
+
+	*nseg = 0;
+
+	/* полная ширина без слоёв и HUD: строки vmem подряд, один проход */
+	if (r->x0 == 0 && r->x1 == width - 1 && !par->compose) {
+		n = min(chunk, (r->y1 - y + 1) * width - x);
+		n = ili9488_pack_runs(par, wire, &lit, vmem + y * width + x,
+				      n, seg, nseg);
+		x += n;
+		*py = y + x / width;
+		*px = x % width;
+		return n * par->bpw;
+	}
+
+	while (n < chunk && y <= r->y1) {
+		int cnt = min(chunk - n, r->x1 - x + 1);
+
+		if (unlikely(par->compose)) {
+			ili9488_pack_px(wire + lit, vmem + y * width + x, cnt);
+			ili9488_compose(par, wire + lit, r, x, y, cnt, outline);
+			if (par->bpw > 1)
+				ili9488_expand18(par, wire + lit, cnt);
+			ili9488_seg_lit(wire, &lit, cnt * par->bpw, seg, nseg);
+		} else {
+			cnt = ili9488_pack_runs(par, wire, &lit,
+						vmem + y * width + x, cnt,
+						seg, nseg);
+		}
+
+		n += cnt;
+		x += cnt;
+		if (x > r->x1) {
+			x = r->x0;
+			y++;
+		}
+	}
+
+	*px = x;
+	*py = y;
+	return n * par->bpw;
+}
+
+#define ILI9488_DEFINE_PACK(name, width)				\
+static int name(struct ili9488_par *par, u16 *wire,			\
+		const struct ili9488_rect *r,				\
+		int *px, int *py, bool outline,				\
+		struct ili9488_seg *seg, int *nseg)			\
+{									\
+	return __ili9488_pack(par, wire, r, px, py, outline,		\
+			      seg, nseg, width);			\
+}
+
+ILI9488_DEFINE_PACK(ili9488_pack_320, 320)
+ILI9488_DEFINE_PACK(ili9488_pack_480, 480)
+ILI9488_DEFINE_PACK(ili9488_pack_640, 640)
+ILI9488_DEFINE_PACK(ili9488_pack_generic, par->width)
+
+static ili9488_pack_fn ili9488_select_pack(struct ili9488_par *par)
+{
+	switch (par->width) {
+	case 320:
+		return ili9488_pack_320;
+	case 480:
+		return ili9488_pack_480;
+	case 640:
+		return ili9488_pack_640;    /* span 2 x 320 */
+	default:
+		return ili9488_pack_generic;
+	}
+}
+
+/*
+ * Вытеснение: пока отправляется группа с приоритетом flush_prio,
+ * пришёл damage приоритетнее. Проверяется между блоками SPI.
+ */
+static bool ili9488_preempted(struct ili9488_par *par)
+{
+	return READ_ONCE(par->pending_prio) < par->flush_prio;
+}
+
+/* вернуть неотправленное в damage, без трассы */
+static void ili9488_requeue(struct ili9488_par *par,
+			    const struct ili9488_rect *r)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&par->dirty_lock, flags);
+	ili9488_add_rect(par, r, ili9488_classify(par, r));
+	spin_unlock_irqrestore(&par->dirty_lock, flags);
+}
+
+/*
+ * Отправить строки r начиная с *py: окно, затем блоки по par->chunk.
+ * При ошибке SPI *py - строка, с которой начинался неудачный блок.
+ */
+static int ili9488_send_rows(struct ili9488_par *par,
+			     struct ili9488_output *out,
+			     const struct ili9488_rect *r, int *py,
+			     bool outline)
+{
+	int x = r->x0;
+	int y = *py;
+	int ret;
+
+	ret = ili9488_set_window(out, r->x0 - out->x_off, y,
+				 r->x1 - out->x_off, r->y1);
+	if (ret)
+		return ret;
+	out->wire_words += ARRAY_SIZE(out->win_buf);
+
+	/* окно с автоинкрементом: строки прямоугольника идут подряд */
+	while (y <= r->y1) {
+		struct ili9488_seg seg[MAX_SEGS];
+		int sy = y;
+		int nseg;
+		int n  = par->pack(par, out->wire, r, &x, &y, outline,
+				   seg, &nseg);
+
+		ret = ili9488_send_wire(out, seg, nseg, n);
+		if (ret) {
+			*py = sy;
+			return ret;
+		}
+		if (bus_slice_us)
+			cond_resched();
+
+		/* строка y могла уйти частично, она отправится заново */
+		if (y <= r->y1 && ili9488_preempted(par)) {
+			out->stop_y = y;
+			return -EAGAIN;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * SMP: блоки по par->chunk слов пакуются параллельно, по одному на
+ * CPU (упаковщик 0 - здесь же), и уходят на шину строго по порядку.
+ * Границы блоков фиксированы (см. ili9488_pack_runs()), так что
+ * начало каждого считается заранее. Пока первый блок на шине,
+ * остальные ещё пакуются.
+ */
+static void ili9488_pack_block(struct ili9488_packer *pk)
+{
+	int x = pk->x;
+	int y = pk->y;
+
+	pk->n = pk->par->pack(pk->par, pk->wire, pk->r, &x, &y, pk->outline,
+			      pk->seg, &pk->nseg);
+}
+
+static void ili9488_packer_work(struct work_struct *work)
+{
+	struct ili9488_packer *pk = container_of(work, struct ili9488_packer,
+						 work);
+
+	ili9488_pack_block(pk);
+	complete(&pk->done);
+}
+
+static int ili9488_send_rows_par(struct ili9488_par *par,
+				 struct ili9488_output *out,
+				 const struct ili9488_rect *r, int *py,
+				 bool outline)
+{
+	int  w     = r->x1 - r->x0 + 1;
+	int  cpx   = par->chunk / par->bpw;
+	int  y0    = *py;
+	long total = (long)(r->y1 - y0 + 1) * w;
+	long off   = 0;
+	int  ret, k, nb;
+
+	ret = ili9488_set_window(out, r->x0 - out->x_off, y0,
+				 r->x1 - out->x_off, r->y1);
+	if (ret)
+		return ret;
+	out->wire_words += ARRAY_SIZE(out->win_buf);
+
+	while (off < total) {
+		int cpu = raw_smp_processor_id();
+
+		for (nb = 0; nb < par->npackers; nb++) {
+			struct ili9488_packer *pk = &out->packers[nb];
+			long o = off + (long)nb * cpx;
+
+			if (o >= total)
+				break;
+			pk->r       = r;
+			pk->outline = outline;
+			pk->x       = r->x0 + o % w;
+			pk->y       = y0 + o / w;
+			if (!nb)
+				continue;
+
+			cpu = cpumask_next(cpu, cpu_online_mask);
+			if (cpu >= nr_cpu_ids)
+				cpu = cpumask_first(cpu_online_mask);
+			reinit_completion(&pk->done);
+			queue_work_on(cpu, system_highpri_wq, &pk->work);
+		}
+
+		ili9488_pack_block(&out->packers[0]);
+
+		/* по порядку; при ошибке всё равно дождаться остальных */
+		for (k = 0; k < nb; k++) {
+			struct ili9488_packer *pk = &out->packers[k];
+
+			if (k)
+				wait_for_completion(&pk->done);
+			if (ret)
+				continue;
+			ret = ili9488_send_wire(out, pk->seg, pk->nseg, pk->n);
+			if (ret)
+				*py = pk->y;
+			else
+				off += pk->n / par->bpw;
+		}
+		if (ret)
+			return ret;
+		if (bus_slice_us)
+			cond_resched();
+
+		if (off < total && ili9488_preempted(par)) {
+			out->stop_y = y0 + off / w;
+			return -EAGAIN;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Прямоугольник r в координатах vmem, обрезается по столбцам панели.
+ * После ошибки SPI положение указателя GRAM неизвестно: окно
+ * открывается заново со строки неудачного блока, с растущей паузой.
+ * Если повторы кончились, out->stop_y - откуда вернуть в damage.
+ */
+static int ili9488_flush_rect(struct ili9488_par *par,
+			      struct ili9488_output *out,
+			      const struct ili9488_rect *rect, bool outline)
+{
+	struct ili9488_rect r = *rect;
+	int y, tries = 0, ret;
+
+	r.x0 = max_t(int, r.x0, out->x_off);
+	r.x1 = min_t(int, r.x1, out->x_off + out->width - 1);
+	if (r.x0 > r.x1)
+		return 0;
+
+	if (ili9488_preempted(par)) {
+		out->stop_y = r.y0;
+		return -EAGAIN;
+	}
+
+	y = r.y0;
+	for (;;) {
+		if (out->packers && rect_area(&r) > par->chunk / par->bpw)
+			ret = ili9488_send_rows_par(par, out, &r, &y, outline);
+		else
+			ret = ili9488_send_rows(par, out, &r, &y, outline);
+		if (!ret || ret == -EAGAIN)
+			return ret;
+
+		if (++tries > FLUSH_RETRIES) {
+			dev_err(&out->spi->dev,
+				"flush: spi error %d at row %d, giving up\n",
+				ret, y);
+			out->stop_y = y;
+			return ret;
+		}
+		out->retries++;
+		usleep_range(FLUSH_BACKOFF_US << tries,
+			     FLUSH_BACKOFF_US << (tries + 1));
+	}
+}
+
+/* прервано на rects[0] со строки out->stop_y: остаток панели в damage */
+static void ili9488_requeue_rest(struct ili9488_par *par,
+				 struct ili9488_output *out,
+				 const struct ili9488_rect *rects, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		struct ili9488_rect r = rects[i];
+
+		r.x0 = max_t(int, r.x0, out->x_off);
+		r.x1 = min_t(int, r.x1, out->x_off + out->width - 1);
+		if (!i)
+			r.y0 = out->stop_y;
+		if (r.x0 <= r.x1 && r.y0 <= r.y1)
+			ili9488_requeue(par, &r);
+	}
+}
+
+static int ili9488_flush_output(struct ili9488_par *par,
+				struct ili9488_output *out,
+				const struct ili9488_rect *rects, int n,
+				bool outline)
+{
+	int i, ret;
+
+	for (i = 0; i < n; i++) {
+		ret = ili9488_flush_rect(par, out, &rects[i], outline);
+		if (ret) {
+			ili9488_requeue_rest(par, out, rects + i, n - i);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void ili9488_output_work(struct work_struct *work)
+{
+	struct ili9488_output *out = container_of(work, struct ili9488_output,
+						  work);
+
+	out->ret = ili9488_flush_output(out->par, out, out->rects,
+					out->nrects, out->outline);
+	complete(&out->done);
+}
+
+/*
+ * Отправить rects на все панели. Вторичные - в своих work параллельно
+ * (разные SPI-контроллеры), первая - здесь же. Под flush_lock.
+ */
+static int ili9488_flush_outputs(struct ili9488_par *par,
+				 const struct ili9488_rect *rects, int n,
+				 bool outline)
+{
+	u64 bus_ns = 0;
+	int ret, i;
+
+	for (i = 1; i < par->nout; i++) {
+		struct ili9488_output *out = par->out[i];
+
+		out->rects   = rects;
+		out->nrects  = n;
+		out->outline = outline;
+		reinit_completion(&out->done);
+		queue_work(system_highpri_wq, &out->work);
+	}
+
+	ret = ili9488_flush_output(par, par->out[0], rects, n, outline);
+
+	for (i = 1; i < par->nout; i++) {
+		wait_for_completion(&par->out[i]->done);
+		if (!ret)
+			ret = par->out[i]->ret;
+	}
+
+	/* загрузка шины - среднее по панелям */
+	for (i = 0; i < par->nout; i++) {
+		struct ili9488_gap_stat *gs = &par->gap_stat[par->qos_held];
+
+		gs->gaps   += par->out[i]->gaps;
+		gs->gap_ns += par->out[i]->gap_ns;
+		gs->gap_max_ns = max(gs->gap_max_ns, par->out[i]->gap_max_ns);
+		par->out[i]->gaps        = 0;
+		par->out[i]->gap_ns      = 0;
+		par->out[i]->gap_max_ns  = 0;
+		par->out[i]->last_end_ns = 0;
+
+		bus_ns          += par->out[i]->bus_ns;
+		par->wire_words += par->out[i]->wire_words;
+		par->hold_max_ns = max(par->hold_max_ns,
+				       par->out[i]->hold_max_ns);
+		par->retries    += par->out[i]->retries;
+		par->solid_words += par->out[i]->solid_words;
+		par->out[i]->bus_ns      = 0;
+		par->out[i]->wire_words  = 0;
+		par->out[i]->hold_max_ns = 0;
+		par->out[i]->retries     = 0;
+		par->out[i]->solid_words = 0;
+	}
+	bus_ns = div_u64(bus_ns, par->nout);
+	par->bus_ns     += bus_ns;
+	par->win_bus_ns += bus_ns;
+
+	return ret;
+}
+
+/*
+ * Забрать damage на отправку. Прямоугольники регионов, чьё окно
+ * ограничения частоты ещё не наступило, остаются в par->dirty[];
+ * *wait_ns - когда откроется ближайшее. Под flush_lock и dirty_lock.
+ */
+static int ili9488_take_damage(struct ili9488_par *par,
+			       struct ili9488_rect *rects, u8 *prio,
+			       u64 now, u64 *wait_ns)
+{
+	unsigned long sent = 0;
+	int i, k, held = 0, n = 0;
+
+	for (i = 0; i < par->ndirty; i++) {
+		int cls = par->dirty_cls[i];
+		struct ili9488_region_state *rg = NULL;
+		u8 p;
+
+		if (cls != REGION_NONE && par->regions[cls].used)
+			rg = &par->regions[cls];
+
+		if (rg && rg->period_ns && now < rg->next_ns) {
+			*wait_ns = min(*wait_ns, rg->next_ns - now);
+			par->dirty_cls[held] = cls;
+			par->dirty[held++]   = par->dirty[i];
+			continue;
+		}
+		if (rg)
+			__set_bit(cls, &sent);
+
+		/* вставка по приоритету, равные сохраняют порядок */
+		p = ili9488_cls_prio(par, cls);
+		for (k = n; k > 0 && prio[k - 1] > p; k--) {
+			rects[k] = rects[k - 1];
+			prio[k]  = prio[k - 1];
+		}
+		rects[k] = par->dirty[i];
+		prio[k]  = p;
+		n++;
+	}
+
+	for_each_set_bit(i, &sent, ILI9488_MAX_REGIONS)
+		par->regions[i].next_ns = now + par->regions[i].period_ns;
+
+	par->rate_held += held;
+	par->ndirty     = held;
+	return n;
+}
+
+/*
+ * Между блоками CPU ждёт прерывания SPI и успевает уйти в глубокий
+ * idle или на низкую частоту, а пауза до следующего блока растёт.
+ * Запросы QoS заведены в probe со значением по умолчанию и меняются
+ * только на время flush. Под flush_lock.
+ */
+static void ili9488_qos_hold(struct ili9488_par *par)
+{
+	int lat = READ_ONCE(flush_qos_us);
+	unsigned int khz = READ_ONCE(flush_min_khz);
+	int i;
+
+	par->qos_held = false;
+	if (lat >= 0) {
+		cpu_latency_qos_update_request(&par->qos_req, lat);
+		par->qos_held = true;
+	}
+	if (khz && par->nfreq) {
+		for (i = 0; i < par->nfreq; i++)
+			freq_qos_update_request(&par->freq_req[i], khz);
+		par->qos_held = true;
+	}
+}
+
+static void ili9488_qos_release(struct ili9488_par *par)
+{
+	int i;
+
+	if (!par->qos_held)
+		return;
+	cpu_latency_qos_update_request(&par->qos_req, PM_QOS_DEFAULT_VALUE);
+	for (i = 0; i < par->nfreq; i++)
+		freq_qos_update_request(&par->freq_req[i],
+					FREQ_QOS_MIN_DEFAULT_VALUE);
+}
+
+/*
+ * Упаковщики идут по cpu_online_mask от текущего CPU, так что нижняя
+ * граница частоты нужна на всех политиках онлайн-CPU. Каждую политику
+ * берём один раз - на её policy->cpu. Ограничения: не больше
+ * MAX_PACKERS политик, и CPU, включённые после probe, не покрыты.
+ * Ошибка добавления не фатальна - без этой политики flush_min_khz
+ * просто не действует.
+ */
+static void ili9488_qos_add(struct ili9488_par *par)
+{
+	struct cpufreq_policy *policy;
+	int cpu, ret;
+
+	cpu_latency_qos_add_request(&par->qos_req, PM_QOS_DEFAULT_VALUE);
+
+	cpus_read_lock();
+	for_each_online_cpu(cpu) {
+		if (par->nfreq == ARRAY_SIZE(par->freq_req)) {
+			dev_warn(&par->spi->dev,
+				 "freq qos: more than %d cpufreq policies, rest not covered\n",
+				 MAX_PACKERS);
+			break;
+		}
+		policy = cpufreq_cpu_get(cpu);
+		if (!policy)
+			continue;
+		if (policy->cpu == cpu) {
+			ret = freq_qos_add_request(&policy->constraints,
+						   &par->freq_req[par->nfreq],
+						   FREQ_QOS_MIN,
+						   FREQ_QOS_MIN_DEFAULT_VALUE);
+			if (ret < 0)
+				dev_warn(&par->spi->dev,
+					 "freq qos on cpu%d: %d\n", cpu, ret);
+			else
+				par->nfreq++;
+		}
+		cpufreq_cpu_put(policy);
+	}
+	cpus_read_unlock();
+}
+
+static void ili9488_qos_remove(struct ili9488_par *par)
+{
+	while (par->nfreq)
+		freq_qos_remove_request(&par->freq_req[--par->nfreq]);
+	cpu_latency_qos_remove_request(&par->qos_req);
+}
+
+/*
+ * Ошибки не проходят и после повторов: панель могла сброситься по
+ * питанию или потерять окно. Заново инициализировать все панели и
+ * отправить весь кадр. Под flush_lock.
+ */
+static void ili9488_reinit(struct ili9488_par *par)
+{
+	int i;
+
+	dev_warn(&par->spi->dev, "%u failed flushes, re-initializing\n",
+		 par->err_streak);
+
+	for (i = 0; i < par->npanels; i++)
+		ili9488_init_display(par, par->panels[i]);
+	par->slpout_ns = ktime_get_ns();
+	ili9488_panel_set(par, PANEL_ON);
+
+	par->reinits++;
+	par->err_streak = 0;
+	ili9488_damage(par, 0, 0, par->width, par->height, ILI9488_SRC_INIT);
+}
+
+static void ili9488_flush(struct ili9488_par *par)
+{
+	struct ili9488_rect rects[MAX_DAMAGE + 1];
+	u8 prio[MAX_DAMAGE + 1];
+	unsigned long flags;
+	bool outline;
+	u64 input_ns, t0, now, wait_ns = U64_MAX;
+	int n, i, j, ret = 0;
+
+	mutex_lock(&par->flush_lock);
+
+	spin_lock_irqsave(&par->dirty_lock, flags);
+	n = ili9488_take_damage(par, rects, prio, ktime_get_ns(), &wait_ns);
+	par->pending_prio = PRIO_IDLE;
+	input_ns = par->dirty_input_ns;
+	par->dirty_input_ns = 0;
+	par->sprite.fx       = par->sprite.x;
+	par->sprite.fy       = par->sprite.y;
+	par->sprite.fvisible = par->sprite.visible;
+	spin_unlock_irqrestore(&par->dirty_lock, flags);
+
+	/* регионы с ограничением частоты: вернуться, когда откроется окно */
+	if (wait_ns != U64_MAX)
+		schedule_delayed_work(&par->flush_work,
+				      nsecs_to_jiffies(wait_ns) + 1);
+
+	if (!n)
+		goto out;
+
+	ili9488_panel_wake(par);
+	if (ili9488_get_buffers(par)) {
+		/* damage уже снят: вернуть его и повторить позже */
+		for (i = 0; i < n; i++)
+			ili9488_requeue(par, &rects[i]);
+		spin_lock_irqsave(&par->dirty_lock, flags);
+		if (!par->dirty_input_ns)
+			par->dirty_input_ns = input_ns;
+		spin_unlock_irqrestore(&par->dirty_lock, flags);
+		par->flush_errors++;
+		mod_delayed_work(system_wq, &par->flush_work,
+				 msecs_to_jiffies(10));
+		goto out;
+	}
+	par->chunk = ili9488_slice_words(par);
+	if (idle_ms)
+		mod_delayed_work(system_wq, &par->idle_work,
+				 msecs_to_jiffies(idle_ms));
+
+	/* HUD обновляется вместе с любым настоящим damage, последним */
+	outline = (par->hud & HUD_OUTLINE) && !par->hud_restore;
+	par->hud_restore = false;
+	if (par->hud & HUD_BOX) {
+		rects[n].x0 = HUD_X(par);
+		rects[n].y0 = HUD_Y;
+		rects[n].x1 = HUD_X(par) + HUD_W - 1;
+		rects[n].y1 = HUD_Y + HUD_H - 1;
+		prio[n]     = ILI9488_PRIO_BULK;
+		n++;
+	}
+
+	/* группы по приоритету; срочный damage вытесняет текущую группу */
+	ili9488_qos_hold(par);
+	t0 = ktime_get_ns();
+	for (i = 0, j = 0; i < n && !ret; i = j) {
+		for (j = i + 1; j < n && prio[j] == prio[i]; j++)
+			;
+		par->flush_prio = prio[i];
+		ret = ili9488_flush_outputs(par, rects + i, j - i, outline);
+	}
+	par->flush_prio = PRIO_IDLE;
+	now = ktime_get_ns();
+	ili9488_qos_release(par);
+	par->gap_stat[par->qos_held].flushes++;
+	par->gap_stat[par->qos_held].flush_ns += now - t0;
+
+	par->flushes++;
+	par->win_flushes++;
+	par->last_flush_ns = now - t0;
+	if (ret) {
+		/* группа уже вернула свой остаток, следующие - целиком */
+		for (; j < n; j++)
+			ili9488_requeue(par, &rects[j]);
+		spin_lock_irqsave(&par->dirty_lock, flags);
+		if (!par->dirty_input_ns)
+			par->dirty_input_ns = input_ns;
+		spin_unlock_irqrestore(&par->dirty_lock, flags);
+	}
+
+	if (ret == -EAGAIN) {
+		par->preempts++;
+		mod_delayed_work(system_wq, &par->flush_work, 0);
+	} else if (ret) {
+		par->flush_errors++;
+		if (++par->err_streak >= REINIT_AFTER)
+			ili9488_reinit(par);
+		mod_delayed_work(system_wq, &par->flush_work,
+				 msecs_to_jiffies(10 << min(par->err_streak, 4U)));
+	} else {
+		par->err_streak = 0;
+		if (input_ns)
+			ili9488_input_done(par, input_ns);
+	}
+
+	if (now - par->win_start_ns >= NSEC_PER_SEC) {
+		u64 dt = now - par->win_start_ns;
+
+		par->fps     = div64_u64((u64)par->win_flushes * NSEC_PER_SEC,
+					 dt);
+		par->bus_pct = div64_u64(par->win_bus_ns * 100, dt);
+		par->win_start_ns = now;
+		par->win_flushes  = 0;
+		par->win_bus_ns   = 0;
+	}
+
+	if (par->hud & HUD_BOX)
+		ili9488_hud_render(par);
+
+	/* рамки видны один кадр, затем прямоугольники отправляются чистыми */
+	if (outline) {
+		par->hud_restore = true;
+		for (i = 0; i < n; i++)
+			ili9488_damage(par, rects[i].x0, rects[i].y0,
+				       rects[i].x1 - rects[i].x0 + 1,
+				       rects[i].y1 - rects[i].y0 + 1,
+				       ILI9488_SRC_HUD);
+		schedule_delayed_work(&par->flush_work, HZ / 10);
+	}
+
+out:
+	mutex_unlock(&par->flush_lock);
+}
+
+static void ili9488_flush_work(struct work_struct *work)
+{
+	struct ili9488_par *par = container_of(to_delayed_work(work),
+					       struct ili9488_par, flush_work);
+
+	ili9488_flush(par);
+}
+
+/*
+ * damage от fb_ops / write: flush не раньше чем через DEFIO_DELAY,
+ * в регионе ILI9488_PRIO_URGENT - сразу
+ */
+static void ili9488_damage_defer(struct ili9488_par *par, int x, int y,
+				 int w, int h, int source)
+{
+	if (ili9488_damage(par, x, y, w, h, source) == ILI9488_PRIO_URGENT)
+		mod_delayed_work(system_wq, &par->flush_work, 0);
+	else
+		schedule_delayed_work(&par->flush_work, DEFIO_DELAY);
+}
+
+/* ------------------------------------------------------------------ */
+/* debugfs: stats, hud                                                  */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Предел fps полного кадра по шине при bpw слов на пиксель: 9 бит на
+ * слово, max_speed_hz первой панели, без учёта пауз между блоками.
+ */
+static u32 ili9488_proj_fps(struct ili9488_par *par, int bpw)
+{
+	u64 bits = ((u64)par->width * par->height * bpw +
+		    ARRAY_SIZE(par->primary.win_buf)) * 9;
+
+	return div64_u64(par->spi->max_speed_hz, bits);
+}
+
+static const char *const panel_names[PANEL_STATES] = {
+	[PANEL_ON]    = "on",
+	[PANEL_IDLE]  = "idle",
+	[PANEL_SLEEP] = "sleep",
+};
+
+static int ili9488_stats_show(struct seq_file *m, void *v)
+{
+	struct ili9488_par *par = m->private;
+	int i;
+
+	mutex_lock(&par->flush_lock);
+	seq_printf(m, "flushes: %llu\n", par->flushes);
+	seq_printf(m, "flush_errors: %llu\n", par->flush_errors);
+	seq_printf(m, "retries: %llu\n", par->retries);
+	seq_printf(m, "reinits: %u\n", par->reinits);
+	seq_printf(m, "wire_words: %llu\n", par->wire_words);
+	seq_printf(m, "solid_words: %llu\n", par->solid_words);
+	seq_printf(m, "defio_faults: %llu\n", par->defio_faults);
+	if (par->yuv_frames) {
+		seq_printf(m, "yuv_frames: %llu\n", par->yuv_frames);
+		seq_printf(m, "yuv_avg_us: %llu\n",
+			   div64_u64(par->yuv_ns,
+				     par->yuv_frames * NSEC_PER_USEC));
+	}
+	if (pte_damage) {
+		seq_printf(m, "pte_scans: %llu\n", par->pte_scans);
+		seq_printf(m, "pte_pages: %llu\n", par->pte_pages);
+		seq_printf(m, "pte_scan_us: %llu\n",
+			   div_u64(par->pte_scan_ns, NSEC_PER_USEC));
+	}
+	if (par->term) {
+		seq_printf(m, "term_cells: %llu\n", par->term->cells_sent);
+		seq_printf(m, "term_glyph_miss: %llu\n",
+			   par->term->glyph_miss);
+	}
+	if (par->primary.model) {
+		seq_printf(m, "model_words: %llu\n",
+			   par->primary.model->words);
+		seq_printf(m, "model_unknown: %u\n",
+			   par->primary.model->unknown);
+	}
+	seq_printf(m, "bus_us: %llu\n", div_u64(par->bus_ns, NSEC_PER_USEC));
+	seq_printf(m, "last_flush_us: %llu\n",
+		   div_u64(par->last_flush_ns, NSEC_PER_USEC));
+	seq_printf(m, "fps: %u\n", par->fps);
+	seq_printf(m, "bus_pct: %u\n", par->bus_pct);
+	seq_printf(m, "trace_lost: %u\n", par->trace_lost);
+	seq_printf(m, "idle_releases: %u\n", par->idle_releases);
+	seq_printf(m, "wake_max_us: %llu\n",
+		   div_u64(par->wake_max_ns, NSEC_PER_USEC));
+	seq_printf(m, "buffers_resident: %d\n", par->buffers);
+	seq_printf(m, "preempts: %llu\n", par->preempts);
+	seq_printf(m, "slice_words: %d\n", ili9488_slice_words(par));
+	seq_printf(m, "pack_cpus: %d\n", par->npackers);
+	seq_printf(m, "colmod: %u\n", par->colmod);      /* 1 / 102 (0x66) */
+	seq_printf(m, "proj_fps_3bit: %u\n", ili9488_proj_fps(par, 1));
+	seq_printf(m, "proj_fps_18bit: %u\n", ili9488_proj_fps(par, 3));
+	seq_printf(m, "bus_hold_max_us: %llu\n",
+		   div_u64(par->hold_max_ns, NSEC_PER_USEC));
+	seq_printf(m, "rate_held: %llu\n", par->rate_held);
+	for (i = 0; i < 2; i++) {
+		const struct ili9488_gap_stat *gs = &par->gap_stat[i];
+		const char *q = i ? "qos" : "noqos";
+
+		seq_printf(m, "%s_flushes: %llu\n", q, gs->flushes);
+		seq_printf(m, "%s_flush_avg_us: %llu\n", q,
+			   gs->flushes ? div64_u64(gs->flush_ns, gs->flushes *
+						  NSEC_PER_USEC) : 0);
+		seq_printf(m, "%s_gap_avg_us: %llu\n", q,
+			   gs->gaps ? div64_u64(gs->gap_ns, gs->gaps *
+						NSEC_PER_USEC) : 0);
+		seq_printf(m, "%s_gap_max_us: %llu\n", q,
+			   div_u64(gs->gap_max_ns, NSEC_PER_USEC));
+	}
+	for (i = 0; i < par->primary.nmirror; i++)
+		seq_printf(m, "mirror%d_errors: %u\n", i,
+			   par->primary.mirror[i]->errors);
+	/* числом, как остальные ключи: 0 - on, 1 - idle, 2 - sleep */
+	seq_printf(m, "panel_state: %u\n", par->panel_state);
+	seq_printf(m, "panel_sleeps: %u\n", par->panel_sleeps);
+	for (i = 0; i < PANEL_STATES; i++) {
+		u64 res = par->panel_res_ns[i];
+
+		if (i == par->panel_state)
+			res += ktime_get_ns() - par->panel_since_ns;
+		seq_printf(m, "panel_%s_ms: %llu\n", panel_names[i],
+			   div_u64(res, NSEC_PER_MSEC));
+	}
+	seq_printf(m, "panel_wake_us: %llu\n",
+		   div_u64(par->panel_wake_ns, NSEC_PER_USEC));
+	seq_printf(m, "panel_wake_max_us: %llu\n",
+		   div_u64(par->panel_wake_max_ns, NSEC_PER_USEC));
+	mutex_unlock(&par->flush_lock);
+
+	return 0;
+}
+
+static int ili9488_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ili9488_stats_show, inode->i_private);
+}
+
+static const struct file_operations ili9488_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = ili9488_stats_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static int ili9488_hud_get(void *data, u64 *val)
+{
+	struct ili9488_par *par = data;
+
+	*val = par->hud;
+	return 0;
+}
+
+static int ili9488_hud_set(void *data, u64 val)
+{
+	struct ili9488_par *par = data;
+
+	if (val & ~(u64)(HUD_BOX | HUD_OUTLINE))
+		return -EINVAL;
+	if (par->width < HUD_W || par->height < HUD_H)
+		return -EINVAL;
+
+	mutex_lock(&par->flush_lock);
+	if (val && !par->hud_img) {
+		par->hud_img = kmalloc(HUD_W * HUD_H, GFP_KERNEL);
+		if (!par->hud_img) {
+			mutex_unlock(&par->flush_lock);
+			return -ENOMEM;
+		}
+	}
+	if (val & HUD_BOX)
+		ili9488_hud_render(par);
+	par->hud = val;
+	ili9488_update_compose(par);
+	if (!val) {
+		kfree(par->hud_img);
+		par->hud_img = NULL;
+	}
+	mutex_unlock(&par->flush_lock);
+
+	/* показать HUD сразу или вернуть картинку из vmem под ним */
+	ili9488_damage_defer(par, HUD_X(par), HUD_Y, HUD_W, HUD_H, ILI9488_SRC_HUD);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(ili9488_hud_fops, ili9488_hud_get,
+			 ili9488_hud_set, "%llu\n");
+
+/* ------------------------------------------------------------------ */
+/* Текстовый терминал                                                   */
+/*                                                                      */
+/* /dev/ili9488_termN: сетка ячеек 8x16 поверх панели (40x30 на 320x480)*/
+/* Запись меняет ячейки и отмечает изменившиеся; отрисовка идёт сразу  */
+/* на шину сериями соседних ячеек строки, слова глифов берутся из кэша */
+/* по (символ, цвета). Цена строки лога - время шины на изменённые     */
+/* символы. vmem обновляется тоже, чтобы flush framebuffer не затирал  */
+/* текст старым содержимым; слои, спрайт и HUD к терминалу не относятся.*/
+/*                                                                      */
+/* Управляющие: \n \r \b \t \f, ESC[0m ESC[3Xm ESC[4Xm ESC[2J ESC[H   */
+/* ------------------------------------------------------------------ */
+
+static const u16 *ili9488_term_glyph(struct ili9488_term *t,
+				     const struct ili9488_cell *c)
+{
+	u32 key = c->ch | c->fg << 8 | c->bg << 16 | BIT(31);
+	struct ili9488_glyph *g = &t->cache[hash_32(key, ilog2(GLYPH_CACHE))];
+	const u8 *bits;
+	int l, i;
+
+	if (g->key == key)
+		return g->words;
+
+	bits = (const u8 *)t->font->data + c->ch * TERM_CH;
+	for (l = 0; l < TERM_CH; l++)
+		for (i = 0; i < TERM_CW; i++)
+			g->words[l * TERM_CW + i] = 0x100 |
+				((bits[l] & (0x80 >> i)) ? c->fg : c->bg);
+	g->key = key;
+	t->glyph_miss++;
+
+	return g->words;
+}
+
+static void ili9488_term_set(struct ili9488_term *t, int idx,
+			     struct ili9488_cell c)
+{
+	struct ili9488_cell *old = &t->cells[idx];
+
+	if (old->ch == c.ch && old->fg == c.fg && old->bg == c.bg)
+		return;
+	*old = c;
+	__set_bit(idx, t->dirty);
+}
+
+static void ili9488_term_clear(struct ili9488_term *t, int from, int to)
+{
+	struct ili9488_cell blank = { ' ', t->fg, t->bg };
+	int i;
+
+	for (i = from; i < to; i++)
+		ili9488_term_set(t, i, blank);
+}
+
+static void ili9488_term_newline(struct ili9488_term *t)
+{
+	int i, n = t->cols * (t->rows - 1);
+
+	t->cx = 0;
+	if (++t->cy < t->rows)
+		return;
+
+	/* прокрутка: панель догоняет только реально изменившиеся ячейки */
+	t->cy = t->rows - 1;
+	for (i = 0; i < n; i++)
+		ili9488_term_set(t, i, t->cells[i + t->cols]);
+	ili9488_term_clear(t, n, n + t->cols);
+}
+
+static void ili9488_term_sgr(struct ili9488_term *t, int a)
+{
+	if (a == 0) {
+		t->fg = 7;
+		t->bg = 0;
+	} else if (a >= 30 && a <= 37) {
+		t->fg = a - 30;
+	} else if (a >= 40 && a <= 47) {
+		t->bg = a - 40;
+	}
+}
+
+static void ili9488_term_putc(struct ili9488_term *t, u8 ch)
+{
+	int i;
+
+	if (t->esc == 1) {
+		t->esc = ch == '[' ? 2 : 0;
+		t->arg[0] = t->arg[1] = 0;
+		t->narg = 0;
+		return;
+	}
+	if (t->esc == 2) {
+		if (ch >= '0' && ch <= '9') {
+			/* длинная строка цифр не переполняет int */
+			if (t->arg[t->narg] <= 9999)
+				t->arg[t->narg] = t->arg[t->narg] * 10 +
+						  ch - '0';
+			return;
+		}
+		if (ch == ';') {
+			t->narg = min(t->narg + 1, 1);
+			return;
+		}
+		t->esc = 0;
+		switch (ch) {
+		case 'm':
+			for (i = 0; i <= t->narg; i++)
+				ili9488_term_sgr(t, t->arg[i]);
+			break;
+		case 'J':
+			ili9488_term_clear(t, 0, t->cols * t->rows);
+			break;
+		case 'H':
+			t->cx = 0;
+			t->cy = 0;
+			break;
+		}
+		return;
+	}
+
+	switch (ch) {
+	case 0x1b:
+		t->esc = 1;
+		break;
+	case '\n':
+		ili9488_term_newline(t);
+		break;
+	case '\r':
+		t->cx = 0;
+		break;
+	case '\b':
+		if (t->cx)
+			t->cx--;
+		break;
+	case '\t':
+		t->cx = min((t->cx + 8) & ~7, t->cols - 1);
+		break;
+	case '\f':
+		ili9488_term_clear(t, 0, t->cols * t->rows);
+		t->cx = 0;
+		t->cy = 0;
+		break;
+	default:
+		if (ch < 0x20)
+			break;
+		if (t->cx >= t->cols)
+			ili9488_term_newline(t);
+		ili9488_term_set(t, t->cy * t->cols + t->cx++,
+				 (struct ili9488_cell){ ch, t->fg, t->bg });
+		break;
+	}
+}
+
+/* серия ячеек row, c0..c1 одной панели: одно окно, слова из кэша */
+static int ili9488_term_send(struct ili9488_term *t, int row, int c0, int c1)
+{
+	struct ili9488_par    *par = t->par;
+	struct ili9488_output *out = par->out[c0 * TERM_CW / par->out[0]->width];
+	int x0 = c0 * TERM_CW;
+	int y0 = row * TERM_CH;
+	int k  = c1 - c0 + 1;
+	const u16 *g[FLUSH_CHUNK / (TERM_CW * TERM_CH)];
+	struct ili9488_seg seg;
+	int c, l, i, off, total, ret;
+
+	for (c = 0; c < k; c++)
+		g[c] = ili9488_term_glyph(t, &t->cells[row * t->cols + c0 + c]);
+
+	for (l = 0; l < TERM_CH; l++) {
+		u8 *v = par->vmem + (y0 + l) * par->width + x0;
+
+		for (c = 0; c < k; c++) {
+			const u16 *src = g[c] + l * TERM_CW;
+
+			memcpy(out->wire + (l * k + c) * TERM_CW, src,
+			       TERM_CW * sizeof(u16));
+			for (i = 0; i < TERM_CW; i++)
+				v[c * TERM_CW + i] = src[i] & 0x07;
+		}
+	}
+
+	ret = ili9488_set_window(out, x0 - out->x_off, y0,
+				 x0 + k * TERM_CW - 1 - out->x_off,
+				 y0 + TERM_CH - 1);
+	if (ret)
+		return ret;
+
+	/* блоками по par->chunk, как flush: bus_slice_us и здесь */
+	total = k * TERM_CW * TERM_CH;
+	for (off = 0; off < total && !ret; off += seg.n) {
+		seg.buf = out->wire + off;
+		seg.n   = min(total - off, par->chunk);
+		ret = ili9488_send_wire(out, &seg, 1, seg.n);
+	}
+	if (!ret)
+		t->cells_sent += k;
+
+	return ret;
+}
+
+/* отправить отмеченные ячейки; под flush_lock */
+static int ili9488_term_render(struct ili9488_term *t)
+{
+	struct ili9488_par *par = t->par;
+	int per_out = par->out[0]->width / TERM_CW;
+	int max_run = FLUSH_CHUNK / (TERM_CW * TERM_CH);
+	int row, c0, c1, ret;
+
+	ili9488_panel_wake(par);
+	ret = ili9488_get_buffers(par);
+	if (ret)
+		return ret;
+	par->chunk = ili9488_slice_words(par);
+	if (idle_ms)
+		mod_delayed_work(system_wq, &par->idle_work,
+				 msecs_to_jiffies(idle_ms));
+
+	for (row = 0; row < t->rows; row++) {
+		unsigned long *d = t->dirty;
+		int base = row * t->cols;
+
+		for (c0 = 0; c0 < t->cols; c0 = c1 + 1) {
+			c1 = c0;
+			if (!test_bit(base + c0, d))
+				continue;
+
+			/* серия не переходит на другую панель span */
+			while (c1 + 1 < t->cols && c1 + 1 - c0 < max_run &&
+			       (c1 + 1) / per_out == c0 / per_out &&
+			       test_bit(base + c1 + 1, d))
+				c1++;
+
+			ret = ili9488_term_send(t, row, c0, c1);
+			if (ret)
+				return ret;
+			bitmap_clear(d, base + c0, c1 - c0 + 1);
+		}
+	}
+
+	return 0;
+}
+
+static ssize_t ili9488_term_write(struct file *file, const char __user *ubuf,
+				  size_t count, loff_t *ppos)
+{
+	struct ili9488_term *t = container_of(file->private_data,
+					      struct ili9488_term, misc);
+	struct ili9488_par  *par = t->par;
+	u8     buf[256];
+	size_t done = 0, i;
+	int    ret;
+
+	mutex_lock(&par->flush_lock);
+	while (done < count) {
+		size_t n = min(count - done, sizeof(buf));
+
+		if (copy_from_user(buf, ubuf + done, n)) {
+			mutex_unlock(&par->flush_lock);
+			return done ? done : -EFAULT;
+		}
+		for (i = 0; i < n; i++)
+			ili9488_term_putc(t, buf[i]);
+		done += n;
+	}
+	ret = ili9488_term_render(t);
+	mutex_unlock(&par->flush_lock);
+
+	/* не дошедшее останется отмеченным до следующей записи */
+	if (ret)
+		dev_err_ratelimited(&par->spi->dev, "term: error %d\n", ret);
+
+	return count;
+}
+
+static const struct file_operations ili9488_term_fops = {
+	.owner  = THIS_MODULE,
+	.write  = ili9488_term_write,
+	.llseek = noop_llseek,
+};
+
+static int ili9488_term_create(struct ili9488_par *par)
+{
+	struct ili9488_term *t;
+	int i, n, ret;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+
+	t->font = find_font("VGA8x16");
+	if (!t->font) {
+		ret = -ENOENT;
+		goto err_free;
+	}
+
+	t->par  = par;
+	t->cols = par->width / TERM_CW;
+	t->rows = par->height / TERM_CH;
+	t->fg   = 7;
+	n = t->cols * t->rows;
+
+	t->cells = kcalloc(n, sizeof(*t->cells), GFP_KERNEL);
+	t->dirty = bitmap_zalloc(n, GFP_KERNEL);
+	if (!t->cells || !t->dirty) {
+		ret = -ENOMEM;
+		goto err_cells;
+	}
+
+	/* панель уже чёрная, пробелы на чёрном не отправляются */
+	for (i = 0; i < n; i++)
+		t->cells[i] = (struct ili9488_cell){ ' ', 7, 0 };
+
+	snprintf(t->name, sizeof(t->name), "ili9488_term%d", par->info->node);
+	t->misc.minor = MISC_DYNAMIC_MINOR;
+	t->misc.name  = t->name;
+	t->misc.fops  = &ili9488_term_fops;
+	t->misc.mode  = 0220;
+	t->misc.parent = &par->spi->dev;
+
+	ret = misc_register(&t->misc);
+	if (ret)
+		goto err_cells;
+
+	par->term = t;
+	return 0;
+
+err_cells:
+	bitmap_free(t->dirty);
+	kfree(t->cells);
+err_free:
+	kfree(t);
+	return ret;
+}
+
+static void ili9488_term_destroy(struct ili9488_par *par)
+{
+	struct ili9488_term *t = par->term;
+
+	if (!t)
+		return;
+
+	misc_deregister(&t->misc);
+	par->term = NULL;
+	bitmap_free(t->dirty);
+	kfree(t->cells);
+	kfree(t);
+}
+
+/* ------------------------------------------------------------------ */
+/* Deferred IO                                                          */
+/*                                                                      */
+/* Вызывается ~20ms после записи в /dev/fb0 через mmap.               */
+/* Список страниц отсортирован; соседние страницы → одна полоса строк. */
+/* ------------------------------------------------------------------ */
+
+/* страницы vmem first..last → полоса строк */
+static void ili9488_damage_pages(struct ili9488_par *par,
+				 unsigned long first, unsigned long last)
+{
+	int y0 = (first << PAGE_SHIFT) / par->width;
+	int y1 = (((last + 1) << PAGE_SHIFT) - 1) / par->width;
+
+	ili9488_damage(par, 0, y0, par->width, y1 - y0 + 1,
+		       ILI9488_SRC_DEFIO);
+}
+
+static void ili9488_deferred_io(struct fb_info *info,
+				struct list_head *pagelist)
+{
+	struct ili9488_par *par = info->par;
+	struct page        *page;
+	unsigned long first = 0, last = 0;
+	bool  run = false;
+	int   n = 0;
+
+	list_for_each_entry(page, pagelist, lru) {
+		if (run && page->index > last + 1) {
+			ili9488_damage_pages(par, first, last);
+			run = false;
+		}
+		if (!run)
+			first = page->index;
+		last = page->index;
+		run  = true;
+		n++;
+	}
+	if (run)
+		ili9488_damage_pages(par, first, last);
+
+	ili9488_flush(par);
+
+	mutex_lock(&par->flush_lock);
+	par->defio_faults += n;
+	mutex_unlock(&par->flush_lock);
+}
+
+static struct fb_deferred_io ili9488_defio = {
+	.delay       = DEFIO_DELAY,
+	.deferred_io = ili9488_deferred_io,
+};
+
+/* ------------------------------------------------------------------ */
+/* Damage по dirty-битам PTE (pte_damage=1)                            */
+/*                                                                      */
+/* Отображение vmem остаётся записываемым, deferred IO не нужен: раз   */
+/* в DEFIO_DELAY pte_work собирает и снимает dirty-биты через          */
+/* clean_record_shared_mapping_range() (mm/mapping_dirty_helpers.c,    */
+/* нужен CONFIG_MAPPING_DIRTY_HELPERS).                                */
+/* На ARMv7 dirty-бит программный: чистая PTE в железе только для      */
+/* чтения, первая запись после сбора - минорный fault в ядре (без      */
+/* page_mkwrite, списка страниц и work), так что дешевле, но не ноль. */
+/* После PTE_IDLE_SCANS пустых сборов отображение защищается от       */
+/* записи и pte_work больше не взводится: первая запись придёт в     */
+/* page_mkwrite, и сбор начнётся снова. Простой без таймера.          */
+/* Поддерживается одно отображение за раз, fork его не наследует.     */
+/* ------------------------------------------------------------------ */
+
+#define PTE_IDLE_SCANS  25      /* ~0.5 с без записи в отображение */
+
+static void ili9488_pte_work(struct work_struct *work)
+{
+	struct ili9488_par *par = container_of(to_delayed_work(work),
+					       struct ili9488_par, pte_work);
+	pgoff_t npages = DIV_ROUND_UP(par->vmem_size, PAGE_SIZE);
+	pgoff_t first = npages, end = 0, i, last;
+	unsigned long pages;
+	struct file *file;
+	u64 t0 = ktime_get_ns();
+
+	spin_lock(&par->pte_lock);
+	file = par->pte_file;
+	if (file)
+		get_file(file);
+	spin_unlock(&par->pte_lock);
+	if (!file)
+		return;
+
+	pages = clean_record_shared_mapping_range(file->f_mapping, 0, npages,
+						  0, par->pte_bitmap,
+						  &first, &end);
+	if (!pages && ++par->pte_idle >= PTE_IDLE_SCANS) {
+		wp_shared_mapping_range(file->f_mapping, 0, npages);
+		/* запись между последним сбором и защитой */
+		pages = clean_record_shared_mapping_range(file->f_mapping, 0,
+							  npages, 0,
+							  par->pte_bitmap,
+							  &first, &end);
+	}
+	if (pages)
+		par->pte_idle = 0;
+	fput(file);
+
+	/* серии подряд идущих страниц - по прямоугольнику */
+	for (i = first; i < end; i = last + 1) {
+		i = find_next_bit(par->pte_bitmap, end, i);
+		if (i >= end)
+			break;
+		last = find_next_zero_bit(par->pte_bitmap, end, i) - 1;
+		ili9488_damage_pages(par, i, last);
+	}
+	if (end > first)
+		bitmap_clear(par->pte_bitmap, first, end - first);
+
+	t0 = ktime_get_ns() - t0;
+	if (pages)
+		ili9488_flush(par);
+
+	mutex_lock(&par->flush_lock);
+	par->pte_scans++;
+	par->pte_pages   += pages;
+	par->pte_scan_ns += t0;
+	mutex_unlock(&par->flush_lock);
+
+	if (par->pte_idle < PTE_IDLE_SCANS)
+		schedule_delayed_work(&par->pte_work, DEFIO_DELAY);
+}
+
+static void ili9488_pte_map_free(struct kref *kref)
+{
+	kfree(container_of(kref, struct ili9488_pte_map, kref));
+}
+
+/* отвязать отображение от par; под pte_lock, ссылка par - вызывающему */
+static struct ili9488_pte_map *ili9488_pte_detach(struct ili9488_par *par,
+						  struct file **file)
+{
+	struct ili9488_pte_map *map = par->pte_map;
+
+	*file = par->pte_file;
+	par->pte_file = NULL;
+	par->pte_map  = NULL;
+	return map;
+}
+
+/* часть VMA после munmap / mprotect середины */
+static void ili9488_pte_open(struct vm_area_struct *vma)
+{
+	struct ili9488_pte_map *map = vma->vm_private_data;
+
+	kref_get(&map->kref);
+}
+
+static void ili9488_pte_close(struct vm_area_struct *vma)
+{
+	struct ili9488_pte_map *map = vma->vm_private_data;
+	struct ili9488_pte_map *own  = NULL;
+	struct file            *file = NULL;
+	struct ili9488_par     *par;
+
+	spin_lock(&map->lock);
+	par = map->par;
+	if (par) {
+		spin_lock(&par->pte_lock);
+		if (par->pte_map == map && par->pte_file == vma->vm_file &&
+		    par->pte_start == vma->vm_start) {
+			own = ili9488_pte_detach(par, &file);
+			map->par = NULL;
+		}
+		spin_unlock(&par->pte_lock);
+	}
+	spin_unlock(&map->lock);
+
+	if (file)
+		fput(file);
+	if (own)
+		kref_put(&own->kref, ili9488_pte_map_free);
+	kref_put(&map->kref, ili9488_pte_map_free);
+}
+
+/* запись в защищённое после простоя отображение: снова собирать */
+static vm_fault_t ili9488_pte_mkwrite(struct vm_fault *vmf)
+{
+	struct ili9488_pte_map *map = vmf->vma->vm_private_data;
+
+	spin_lock(&map->lock);
+	if (map->par)
+		schedule_delayed_work(&map->par->pte_work, DEFIO_DELAY);
+	spin_unlock(&map->lock);
+
+	/* у страниц vmalloc нет mapping: без LOCKED fault повторяется */
+	lock_page(vmf->page);
+	return VM_FAULT_LOCKED;
+}
+
+static const struct vm_operations_struct ili9488_pte_vm_ops = {
+	.open         = ili9488_pte_open,
+	.close        = ili9488_pte_close,
+	.page_mkwrite = ili9488_pte_mkwrite,
+};
+
+/* remove(): отображение может остаться, но без par */
+static void ili9488_pte_release(struct ili9488_par *par)
+{
+	struct ili9488_pte_map *map;
+	struct file            *file;
+
+	spin_lock(&par->pte_lock);
+	map = ili9488_pte_detach(par, &file);
+	spin_unlock(&par->pte_lock);
+
+	if (map) {
+		spin_lock(&map->lock);
+		map->par = NULL;
+		spin_unlock(&map->lock);
+		kref_put(&map->kref, ili9488_pte_map_free);
+	}
+	if (file)
+		fput(file);
+}
+
+static int ili9488_pte_mmap(struct fb_info *info, struct vm_area_struct *vma)
+{
+	struct ili9488_par     *par = info->par;
+	struct ili9488_pte_map *map;
+	int ret;
+
+	spin_lock(&par->pte_lock);
+	ret = par->pte_file ? -EBUSY : 0;
+	spin_unlock(&par->pte_lock);
+	if (ret)
+		return ret;
+
+	ret = remap_vmalloc_range(vma, par->vmem, vma->vm_pgoff);
+	if (ret)
+		return ret;
+
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
+	kref_init(&map->kref);           /* ссылка VMA */
+	spin_lock_init(&map->lock);
+	map->par = par;
+
+	spin_lock(&par->pte_lock);
+	if (par->pte_file) {
+		ret = -EBUSY;
+	} else {
+		kref_get(&map->kref);    /* ссылка par */
+		par->pte_file  = get_file(vma->vm_file);
+		par->pte_start = vma->vm_start;
+		par->pte_map   = map;
+	}
+	spin_unlock(&par->pte_lock);
+	if (ret) {
+		kfree(map);
+		return ret;
+	}
+
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTCOPY;
+	vma->vm_ops          = &ili9488_pte_vm_ops;
+	vma->vm_private_data = map;
+
+	par->pte_idle = 0;
+	schedule_delayed_work(&par->pte_work, DEFIO_DELAY);
+	return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* ioctl                                                                */
+/* ------------------------------------------------------------------ */
+
+/* ILI9488_IOC_LAYER_SET: включить / выключить слой, задать ключ */
+static int ili9488_layer_set(struct ili9488_par *par,
+			     const struct ili9488_layer_cfg *cfg)
+{
+	struct ili9488_layer *layer;
+	struct ili9488_rect   extent = { 0 };
+	bool used;
+
+	if (cfg->index >= ILI9488_MAX_LAYERS)
+		return -EINVAL;
+
+	layer = &par->layers[cfg->index];
+
+	mutex_lock(&par->flush_lock);
+	if (cfg->enable && !layer->buf) {
+		layer->buf = vmalloc(par->vmem_size);
+		if (!layer->buf) {
+			mutex_unlock(&par->flush_lock);
+			return -ENOMEM;
+		}
+		memset(layer->buf, cfg->key, par->vmem_size);
+		layer->used = false;
+	}
+	used   = layer->used;
+	extent = layer->extent;
+	if (!cfg->enable) {
+		vfree(layer->buf);
+		layer->buf  = NULL;
+		layer->used = false;
+	}
+	layer->key = cfg->key;
+	ili9488_update_compose(par);
+	mutex_unlock(&par->flush_lock);
+
+	/* показать или убрать содержимое слоя */
+	if (used)
+		ili9488_damage_defer(par, extent.x0, extent.y0,
+				     extent.x1 - extent.x0 + 1,
+				     extent.y1 - extent.y0 + 1,
+				     ILI9488_SRC_LAYER);
+	return 0;
+}
+
+/*
+ * 3-битный режим: байт вне 0x00-0x07 ушёл бы на шину как есть. Такие
+ * байты (кроме key) становятся key, true - если были.
+ */
+static bool ili9488_layer_fix_row(u8 *p, int n, u8 key)
+{
+	bool bad = false;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (p[i] > 0x07 && p[i] != key) {
+			p[i] = key;
+			bad  = true;
+		}
+	}
+	return bad;
+}
+
+/* ILI9488_IOC_LAYER_WRITE: скопировать прямоугольник пикселей в слой */
+static int ili9488_layer_write(struct ili9488_par *par,
+			       const struct ili9488_layer_blit *blit)
+{
+	const u8 __user *src = u64_to_user_ptr(blit->data);
+	struct ili9488_layer *layer;
+	struct ili9488_rect   r;
+	bool written = false;
+	int row, ret = 0;
+
+	if (blit->index >= ILI9488_MAX_LAYERS || !blit->w || !blit->h ||
+	    blit->x + blit->w > par->width || blit->y + blit->h > par->height)
+		return -EINVAL;
+
+	r.x0 = blit->x;
+	r.y0 = blit->y;
+	r.x1 = blit->x + blit->w - 1;
+	r.y1 = blit->y + blit->h - 1;
+
+	layer = &par->layers[blit->index];
+
+	mutex_lock(&par->flush_lock);
+	if (!layer->buf) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	for (row = 0; row < blit->h; row++) {
+		u8 *dst = layer->buf + (blit->y + row) * par->width + blit->x;
+
+		if (copy_from_user(dst, src + row * blit->w, blit->w)) {
+			ret = -EFAULT;
+			break;
+		}
+		if (par->bpw == 1 &&
+		    ili9488_layer_fix_row(dst, blit->w, layer->key)) {
+			ret = -EINVAL;
+			break;
+		}
+	}
+	/* строки до ошибки (и сама строка) уже в слое - показать их */
+	if (ret)
+		r.y1 = blit->y + row;
+
+	if (layer->used)
+		rect_union(&layer->extent, &r);
+	else
+		layer->extent = r;
+	layer->used = true;
+	written = true;
+out:
+	mutex_unlock(&par->flush_lock);
+
+	if (written)
+		ili9488_damage_defer(par, r.x0, r.y0, blit->w, r.y1 - r.y0 + 1,
+				     ILI9488_SRC_LAYER);
+	return ret;
+}
+
+/* ILI9488_IOC_SPRITE_SET: новая картинка и маска спрайта */
+/* 3-битный режим: непрозрачные пиксели спрайта только 0x00-0x07 */
+static bool ili9488_sprite_colors_ok(const struct ili9488_par *par)
+{
+	int pitch = DIV_ROUND_UP(par->sprite.w, 8);
+	int x, y;
+
+	if (par->bpw > 1)
+		return true;
+	for (y = 0; y < par->sprite.h; y++)
+		for (x = 0; x < par->sprite.w; x++)
+			if ((par->sprite.mask[y * pitch + x / 8] &
+			     (0x80 >> (x % 8))) &&
+			    par->sprite.img[y * par->sprite.w + x] > 0x07)
+				return false;
+	return true;
+}
+
+static int ili9488_sprite_set(struct ili9488_par *par,
+			      const struct ili9488_sprite_img *si)
+{
+	int pitch = DIV_ROUND_UP(si->w, 8);
+	unsigned long flags;
+	int ox, oy, ow, oh;
+	bool was_visible;
+	int ret = 0;
+
+	if (!si->w || !si->h ||
+	    si->w > ILI9488_SPRITE_MAX || si->h > ILI9488_SPRITE_MAX)
+		return -EINVAL;
 
-#define FLUSH_CHUNK  2048       /* пикселей за один spi_sync */
-#define DEFIO_DELAY  (HZ / 50) /* ~20ms между flush (50 fps max) */
+	mutex_lock(&par->flush_lock);
+	ow = par->sprite.w;
+	oh = par->sprite.h;
+	if (copy_from_user(par->sprite.img, u64_to_user_ptr(si->data),
+			   si->w * si->h) ||
+	    copy_from_user(par->sprite.mask, u64_to_user_ptr(si->mask),
+			   pitch * si->h)) {
+		ret = -EFAULT;
+	} else {
+		par->sprite.w = si->w;
+		par->sprite.h = si->h;
+		if (!ili9488_sprite_colors_ok(par))
+			ret = -EINVAL;
+	}
 
-struct ili9488_par {
-	struct spi_device *spi;
-	struct fb_info    *info;
-	u8                *vmem;
-	struct gpio_desc  *reset_gpiod;
-	struct gpio_desc  *bl_gpiod;
-};
+	/* картинка испорчена: снять спрайт, старое место перерисовать */
+	spin_lock_irqsave(&par->dirty_lock, flags);
+	ox = par->sprite.x;
+	oy = par->sprite.y;
+	was_visible = par->sprite.visible;
+	if (ret) {
+		par->sprite.visible = false;
+		par->sprite.w = 0;
+		par->sprite.h = 0;
+	}
+	spin_unlock_irqrestore(&par->dirty_lock, flags);
+	ili9488_update_compose(par);
+	mutex_unlock(&par->flush_lock);
 
-/* ------------------------------------------------------------------ */
-/* SPI 9-bit helpers                                                   */
-/*                                                                      */
-/* 9-bit word: бит8 = D/C, биты7..0 = данные                         */
-/* D/C=0 → команда, D/C=1 → данные                                   */
-/* ------------------------------------------------------------------ */
+	/* прежний размер не больше ILI9488_SPRITE_MAX: квадрат покрывает и его */
+	if (was_visible)
+		ili9488_damage_defer(par, ox, oy,
+				     ret ? ow : ILI9488_SPRITE_MAX,
+				     ret ? oh : ILI9488_SPRITE_MAX,
+				     ILI9488_SRC_SPRITE);
+	return ret;
+}
 
-static int spi_9bit(struct spi_device *spi, u16 word)
+/*
+ * ILI9488_IOC_SPRITE_MOVE: новая позиция / видимость.
+ * Не ждёт идущий flush: позиция снимается в начале каждого flush.
+ */
+static int ili9488_sprite_move(struct ili9488_par *par,
+			       const struct ili9488_sprite_pos *sp)
 {
-	struct spi_transfer t;
-	struct spi_message  m;
+	unsigned long flags;
+	int ox, oy, w, h;
+	bool was_visible;
 
-	memset(&t, 0, sizeof(t));
-	t.tx_buf        = &word;
-	t.len           = 2;
-	t.bits_per_word = 9;
+	if (sp->x < -ILI9488_SPRITE_MAX || sp->x >= par->width ||
+	    sp->y < -ILI9488_SPRITE_MAX || sp->y >= par->height)
+		return -EINVAL;
 
-	spi_message_init(&m);
-	spi_message_add_tail(&t, &m);
-	return spi_sync(spi, &m);
+	spin_lock_irqsave(&par->dirty_lock, flags);
+	ox = par->sprite.x;
+	oy = par->sprite.y;
+	w  = par->sprite.w;
+	h  = par->sprite.h;
+	was_visible = par->sprite.visible;
+	par->sprite.x       = sp->x;
+	par->sprite.y       = sp->y;
+	par->sprite.visible = sp->visible && w && h;
+	spin_unlock_irqrestore(&par->dirty_lock, flags);
+
+	if (was_visible)
+		ili9488_damage(par, ox, oy, w, h, ILI9488_SRC_SPRITE);
+	if (par->sprite.visible)
+		ili9488_damage(par, sp->x, sp->y, w, h, ILI9488_SRC_SPRITE);
+	mod_delayed_work(system_wq, &par->flush_work, 0);
+
+	return 0;
 }
 
-static inline int lcd_cmd(struct spi_device *spi, u8 cmd)
+/*
+ * Старшие 6 бит каждого канала; RGB332 растягивается на 0..255, так
+ * что белый 0xFF остаётся белым.
+ */
+static void ili9488_init_lut18(struct ili9488_par *par)
 {
-	return spi_9bit(spi, (u16)cmd);
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		par->lut18[i][0] = 0x100 | ((((i >> 5) & 7) * 255 / 7) & 0xFC);
+		par->lut18[i][1] = 0x100 | ((((i >> 2) & 7) * 255 / 7) & 0xFC);
+		par->lut18[i][2] = 0x100 | (((i & 3) * 85) & 0xFC);
+	}
 }
 
-static inline int lcd_data(struct spi_device *spi, u8 data)
+/* формат пикселя vmem для userspace: 3 бита как было, иначе RGB332 */
+static void ili9488_set_color_var(struct ili9488_par *par)
 {
-	return spi_9bit(spi, 0x100 | (u16)data);
+	struct fb_var_screeninfo *var = &par->info->var;
+
+	if (par->bpw > 1) {
+		var->red   = (struct fb_bitfield){ .offset = 5, .length = 3 };
+		var->green = (struct fb_bitfield){ .offset = 2, .length = 3 };
+		var->blue  = (struct fb_bitfield){ .offset = 0, .length = 2 };
+	} else {
+		var->red   = (struct fb_bitfield){ .offset = 0, .length = 8 };
+		var->green = (struct fb_bitfield){ .offset = 0, .length = 8 };
+		var->blue  = (struct fb_bitfield){ .offset = 0, .length = 8 };
+	}
 }
 
-/* ------------------------------------------------------------------ */
-/* Hardware reset                                                       */
-/* ------------------------------------------------------------------ */
+/*
+ * ILI9488_IOC_COLOR_MODE: COLMOD 0x01 (байт vmem - цвет в битах 2..0,
+ * слово на пиксель) или 0x66 (байт vmem - RGB332, три слова на
+ * пиксель). vmem не меняется: приложение перерисовывает экран в новом
+ * формате, полный кадр уходит сразу. Терминал пишет 3-битные ячейки
+ * напрямую, с ним 18 бит недоступны.
+ */
+static int ili9488_color_mode(struct ili9488_par *par, u32 mode)
+{
+	u8  colmod = mode == ILI9488_COLOR_18BIT ? 0x66 : 0x01;
+	int i, ret = 0;
+
+	if (mode > ILI9488_COLOR_18BIT)
+		return -EINVAL;
+
+	mutex_lock(&par->flush_lock);
+	if (par->term && mode == ILI9488_COLOR_18BIT) {
+		mutex_unlock(&par->flush_lock);
+		return -EBUSY;
+	}
+	if (colmod != par->colmod) {
+		par->colmod = colmod;
+		par->bpw    = colmod == 0x66 ? 3 : 1;
+		for (i = 0; i < par->npanels && !ret; i++) {
+			ret = lcd_cmd(par->panels[i], 0x3A);
+			if (!ret)
+				ret = lcd_data(par->panels[i], colmod);
+		}
+		ili9488_set_color_var(par);
+		if (par->hud_img)
+			ili9488_hud_render(par);
+	}
+	mutex_unlock(&par->flush_lock);
+
+	/* при ошибке SPI reinit всё равно пошлёт par->colmod */
+	ili9488_damage(par, 0, 0, par->width, par->height, ILI9488_SRC_INIT);
+	mod_delayed_work(system_wq, &par->flush_work, 0);
+	return ret;
+}
 
-static void ili9488_hw_reset(struct ili9488_par *par)
+/* ILI9488_IOC_REGION_SET: задать / удалить регион обновления */
+static int ili9488_region_set(struct ili9488_par *par,
+			      const struct ili9488_region *rg)
 {
-	if (!par->reset_gpiod)
-		return;
+	struct ili9488_region_state *st;
+	unsigned long flags;
+	bool used = rg->w && rg->h;
 
-	gpiod_set_value_cansleep(par->reset_gpiod, 0);
-	msleep(20);
-	gpiod_set_value_cansleep(par->reset_gpiod, 1);
-	msleep(120);
+	if (rg->index >= ILI9488_MAX_REGIONS || rg->prio > ILI9488_PRIO_BULK)
+		return -EINVAL;
+	if (used && (rg->x >= par->width || rg->y >= par->height))
+		return -EINVAL;
+
+	spin_lock_irqsave(&par->dirty_lock, flags);
+	st = &par->regions[rg->index];
+	memset(st, 0, sizeof(*st));
+	if (used) {
+		st->used      = true;
+		st->r.x0      = rg->x;
+		st->r.y0      = rg->y;
+		st->r.x1      = min_t(int, rg->x + rg->w, par->width) - 1;
+		st->r.y1      = min_t(int, rg->y + rg->h, par->height) - 1;
+		st->prio      = rg->prio;
+		st->period_ns = rg->max_hz ?
+				div_u64(NSEC_PER_SEC, rg->max_hz) : 0;
+	}
+	spin_unlock_irqrestore(&par->dirty_lock, flags);
+
+	return 0;
 }
 
-/* ------------------------------------------------------------------ */
-/* Display initialisation                                               */
-/* ------------------------------------------------------------------ */
+/* начало строки приёмника dy в vmem */
+static inline u8 *ili9488_yuv_dst(struct ili9488_par *par,
+				  const struct ili9488_yuv_frame *f, int dy)
+{
+	return par->vmem + (f->y + dy) * par->width + f->x;
+}
 
-static void ili9488_init_display(struct ili9488_par *par)
+/*
+ * ILI9488_IOC_YUV_FRAME: кадр камеры в vmem и сразу на панель.
+ * Исходные строки копируются по одной, суммы копятся в строке
+ * приёмника (усреднение по площади), строка квантуется, когда
+ * исходные строки для неё кончились. Flush без DEFIO_DELAY: частоту
+ * превью ограничивает шина, а не ожидание. Само преобразование - в
+ * ili9488_yuv.h, общем с ili9488-bench -y.
+ */
+static int ili9488_yuv_frame(struct ili9488_par *par,
+			     const struct ili9488_yuv_frame *f)
 {
-	struct spi_device *spi = par->spi;
+	const u8 __user *base = u64_to_user_ptr(f->data);
+	bool nv12 = f->format == ILI9488_YUV_NV12;
+	u64  cbase, cstride;
+	int  cx0, cn, sx, sy, dy = 0, ret = 0;
+	u32 *acc, *cnt;
+	u16 *xmap;
+	u8  *ybuf, *cbuf;
+	u8   bpw;
+	u64  t0 = ktime_get_ns();
 
-	ili9488_hw_reset(par);
+	if (f->format > ILI9488_YUV_I420 ||
+	    f->dither > ILI9488_DITHER_ORDERED ||
+	    !f->width || !f->height || f->stride < f->width ||
+	    !f->crop_w || !f->crop_h ||
+	    f->crop_x + f->crop_w > f->width ||
+	    f->crop_y + f->crop_h > f->height ||
+	    !f->w || !f->h || f->w > f->crop_w || f->h > f->crop_h ||
+	    f->x + f->w > par->width || f->y + f->h > par->height)
+		return -EINVAL;
+	/* суммы u32: не больше 2^16 исходных пикселей на один */
+	if ((u64)f->crop_w * f->crop_h > ((u64)f->w * f->h) << 16)
+		return -EINVAL;
 
-	lcd_cmd(spi, 0x01); msleep(150); /* SWRESET   */
-	lcd_cmd(spi, 0x11); msleep(120); /* SLEEP OUT */
+	/* режим цвета меняется под flush_lock: кадр целиком в одном */
+	mutex_lock(&par->flush_lock);
+	bpw = par->bpw;
+	mutex_unlock(&par->flush_lock);
 
-	lcd_cmd(spi,  0x3A);             /* COLMOD: 3-bit/pixel */
-	lcd_data(spi, 0x01);
-	msleep(10);
+	cbase   = (u64)f->stride * f->height;
+	cstride = nv12 ? f->stride : DIV_ROUND_UP(f->stride, 2);
+	cx0     = f->crop_x / 2;
+	cn      = (f->crop_x + f->crop_w - 1) / 2 - cx0 + 1;
 
-	lcd_cmd(spi,  0x36);             /* MADCTL: MX=1, BGR=1 */
-	lcd_data(spi, 0x48);
-	msleep(10);
+	/* acc[3 * w], cnt[w], xmap[crop_w], ybuf[crop_w], cbuf[2 * cn] */
+	acc = kvmalloc(4 * f->w * sizeof(u32) + f->crop_w * sizeof(u16) +
+		       f->crop_w + 2 * cn, GFP_KERNEL);
+	if (!acc)
+		return -ENOMEM;
+	cnt  = acc + 3 * f->w;
+	xmap = (u16 *)(cnt + f->w);
+	ybuf = (u8 *)(xmap + f->crop_w);
+	cbuf = ybuf + f->crop_w;
 
-	lcd_cmd(spi, 0x21); msleep(10);  /* INVON  */
-	lcd_cmd(spi, 0x13); msleep(10);  /* NORON  */
-	lcd_cmd(spi, 0x29); msleep(50);  /* DISPON */
+	for (sx = 0; sx < f->crop_w; sx++)
+		xmap[sx] = sx * f->w / f->crop_w;
+	memset(acc, 0, 4 * f->w * sizeof(u32));
 
-	dev_info(&par->spi->dev, "display init done\n");
-}
+	for (sy = f->crop_y; sy < f->crop_y + f->crop_h; sy++) {
+		int ndy = (sy - f->crop_y) * f->h / f->crop_h;
+		u64 crow = cbase + (sy / 2) * cstride;
 
-/* ------------------------------------------------------------------ */
-/* Set GRAM write window + RAMWR                                        */
-/* ------------------------------------------------------------------ */
+		if (ndy != dy) {
+			ili9488_yuv_emit_row(f, dy, acc, cnt,
+					     ili9488_yuv_dst(par, f, dy),
+					     bpw > 1);
+			memset(acc, 0, 4 * f->w * sizeof(u32));
+			dy = ndy;
+		}
 
-static void ili9488_set_window(struct spi_device *spi,
-			       u16 x0, u16 y0, u16 x1, u16 y1)
-{
-	lcd_cmd(spi,  0x2A);
-	lcd_data(spi, x0 >> 8); lcd_data(spi, x0 & 0xFF);
-	lcd_data(spi, x1 >> 8); lcd_data(spi, x1 & 0xFF);
+		if (copy_from_user(ybuf, base + (u64)sy * f->stride + f->crop_x,
+				   f->crop_w)) {
+			ret = -EFAULT;
+			break;
+		}
+		/* cbuf: NV12 - UVUV..., I420 - U[cn] затем V[cn] */
+		if (nv12)
+			ret = copy_from_user(cbuf, base + crow + 2 * cx0, 2 * cn);
+		else
+			ret = copy_from_user(cbuf, base + crow + cx0, cn) ||
+			      copy_from_user(cbuf + cn, base + crow + cx0 +
+					     cstride * DIV_ROUND_UP(f->height, 2),
+					     cn);
+		if (ret) {
+			ret = -EFAULT;
+			break;
+		}
 
-	lcd_cmd(spi,  0x2B);
-	lcd_data(spi, y0 >> 8); lcd_data(spi, y0 & 0xFF);
-	lcd_data(spi, y1 >> 8); lcd_data(spi, y1 & 0xFF);
+		ili9488_yuv_acc_row(f, acc, cnt, xmap, ybuf, cbuf, cx0, cn);
+	}
+	if (!ret)
+		ili9488_yuv_emit_row(f, dy, acc, cnt,
+				     ili9488_yuv_dst(par, f, dy), bpw > 1);
+	kvfree(acc);
+	if (ret)
+		return ret;
 
-	lcd_cmd(spi,  0x2C); /* RAMWR */
-}
+	mutex_lock(&par->flush_lock);
+	par->yuv_frames++;
+	par->yuv_ns += ktime_get_ns() - t0;
+	mutex_unlock(&par->flush_lock);
 
-/* ------------------------------------------------------------------ */
-/* Flush: отправка vmem на дисплей                                     */
-/*                                                                      */
-/* Каждый байт vmem (0x00-0x07) → 9-bit SPI слово: 0x100 | byte      */
-/* FLUSH_CHUNK пикселей за один spi_sync (избегаем таймаут PL022)     */
-/* ------------------------------------------------------------------ */
+	ili9488_damage(par, f->x, f->y, f->w, f->h, ILI9488_SRC_YUV);
+	mod_delayed_work(system_wq, &par->flush_work, 0);
+	return 0;
+}
 
-static void ili9488_flush(struct ili9488_par *par)
+static int ili9488_fb_ioctl(struct fb_info *info, unsigned int cmd,
+			    unsigned long arg)
 {
-	struct spi_device *spi  = par->spi;
-	u8                *vmem = par->vmem;
-	u16               *chunk;
-	int                sent = 0;
-	int                total = LCD_WIDTH * LCD_HEIGHT;
-	int                ret;
-
-	chunk = kmalloc(FLUSH_CHUNK * sizeof(u16), GFP_KERNEL);
-	if (!chunk)
-		return;
+	struct ili9488_par *par  = info->par;
+	void __user        *argp = (void __user *)arg;
 
-	ili9488_set_window(spi, 0, 0, LCD_WIDTH - 1, LCD_HEIGHT - 1);
+	switch (cmd) {
+	case ILI9488_IOC_LAYER_SET: {
+		struct ili9488_layer_cfg cfg;
 
-	while (sent < total) {
-		struct spi_transfer t;
-		struct spi_message  m;
-		int n = min(FLUSH_CHUNK, total - sent);
-		int i;
+		if (copy_from_user(&cfg, argp, sizeof(cfg)))
+			return -EFAULT;
+		return ili9488_layer_set(par, &cfg);
+	}
+	case ILI9488_IOC_LAYER_WRITE: {
+		struct ili9488_layer_blit blit;
 
-		for (i = 0; i < n; i++)
-			chunk[i] = 0x100 | vmem[sent + i];
+		if (copy_from_user(&blit, argp, sizeof(blit)))
+			return -EFAULT;
+		return ili9488_layer_write(par, &blit);
+	}
+	case ILI9488_IOC_SPRITE_SET: {
+		struct ili9488_sprite_img si;
 
-		memset(&t, 0, sizeof(t));
-		t.tx_buf        = chunk;
-		t.len           = n * sizeof(u16);
-		t.bits_per_word = 9;
+		if (copy_from_user(&si, argp, sizeof(si)))
+			return -EFAULT;
+		return ili9488_sprite_set(par, &si);
+	}
+	case ILI9488_IOC_SPRITE_MOVE: {
+		struct ili9488_sprite_pos sp;
 
-		spi_message_init(&m);
-		spi_message_add_tail(&t, &m);
+		if (copy_from_user(&sp, argp, sizeof(sp)))
+			return -EFAULT;
+		return ili9488_sprite_move(par, &sp);
+	}
+	case ILI9488_IOC_REGION_SET: {
+		struct ili9488_region rg;
 
-		ret = spi_sync(spi, &m);
-		if (ret) {
-			dev_err(&spi->dev, "flush: spi error %d at px %d\n",
-				ret, sent);
-			break;
-		}
+		if (copy_from_user(&rg, argp, sizeof(rg)))
+			return -EFAULT;
+		return ili9488_region_set(par, &rg);
+	}
+	case ILI9488_IOC_YUV_FRAME: {
+		struct ili9488_yuv_frame f;
 
-		sent += n;
+		if (copy_from_user(&f, argp, sizeof(f)))
+			return -EFAULT;
+		return ili9488_yuv_frame(par, &f);
 	}
+	case ILI9488_IOC_COLOR_MODE: {
+		__u32 mode;
 
-	kfree(chunk);
+		if (get_user(mode, (__u32 __user *)argp))
+			return -EFAULT;
+		return ili9488_color_mode(par, mode);
+	}
+	default:
+		return -ENOTTY;
+	}
 }
 
 /* ------------------------------------------------------------------ */
-/* Deferred IO                                                          */
-/*                                                                      */
-/* Вызывается ~20ms после записи в /dev/fb0 через mmap/write.         */
+/* fb_ops                                                               */
 /* ------------------------------------------------------------------ */
 
-static void ili9488_deferred_io(struct fb_info *info,
-				struct list_head *pagelist)
+static ssize_t ili9488_fb_write(struct fb_info *info, const char __user *buf,
+				size_t count, loff_t *ppos)
 {
-	ili9488_flush(info->par);
-}
+	struct ili9488_par *par = info->par;
+	loff_t  pos = *ppos;
+	ssize_t ret;
 
-static struct fb_deferred_io ili9488_defio = {
-	.delay       = DEFIO_DELAY,
-	.deferred_io = ili9488_deferred_io,
-};
+	ret = fb_sys_write(info, buf, count, ppos);
+	if (ret > 0) {
+		int y0 = pos / par->width;
+		int y1 = (pos + ret - 1) / par->width;
 
-/* ------------------------------------------------------------------ */
-/* fb_ops                                                               */
-/* ------------------------------------------------------------------ */
+		ili9488_damage_defer(par, 0, y0, par->width,
+				     y1 - y0 + 1, ILI9488_SRC_WRITE);
+	}
+
+	return ret;
+}
 
 static void ili9488_fb_fillrect(struct fb_info *info,
 				const struct fb_fillrect *rect)
 {
 	cfb_fillrect(info, rect);
+	ili9488_damage_defer(info->par, rect->dx, rect->dy,
+			     rect->width, rect->height, ILI9488_SRC_FILLRECT);
 }
 
 static void ili9488_fb_copyarea(struct fb_info *info,
 				const struct fb_copyarea *area)
 {
 	cfb_copyarea(info, area);
+	ili9488_damage_defer(info->par, area->dx, area->dy,
+			     area->width, area->height, ILI9488_SRC_COPYAREA);
 }
 
 static void ili9488_fb_imageblit(struct fb_info *info,
 				 const struct fb_image *image)
 {
 	cfb_imageblit(info, image);
+	ili9488_damage_defer(info->par, image->dx, image->dy,
+			     image->width, image->height,
+			     ILI9488_SRC_IMAGEBLIT);
 }
 
 static struct fb_ops ili9488_fbops = {
 	.owner        = THIS_MODULE,
+	.fb_read      = fb_sys_read,
+	.fb_write     = ili9488_fb_write,
 	.fb_fillrect  = ili9488_fb_fillrect,
 	.fb_copyarea  = ili9488_fb_copyarea,
 	.fb_imageblit = ili9488_fb_imageblit,
+	.fb_ioctl     = ili9488_fb_ioctl,
 };
 
 /* ------------------------------------------------------------------ */
@@ -238,14 +3796,9 @@ static struct fb_fix_screeninfo ili9488_fix = {
 	.type        = FB_TYPE_PACKED_PIXELS,
 	.visual      = FB_VISUAL_TRUECOLOR,
 	.accel       = FB_ACCEL_NONE,
-	.line_length = LCD_WIDTH,   /* 1 байт на пиксель */
 };
 
 static struct fb_var_screeninfo ili9488_var = {
-	.xres           = LCD_WIDTH,
-	.yres           = LCD_HEIGHT,
-	.xres_virtual   = LCD_WIDTH,
-	.yres_virtual   = LCD_HEIGHT,
 	.bits_per_pixel = LCD_BPP,
 	.red    = { .offset = 0, .length = 8, .msb_right = 0 },
 	.green  = { .offset = 0, .length = 8, .msb_right = 0 },
@@ -255,18 +3808,230 @@ static struct fb_var_screeninfo ili9488_var = {
 	.vmode    = FB_VMODE_NONINTERLACED,
 };
 
+/* ------------------------------------------------------------------ */
+/* Геометрия из DT                                                      */
+/*                                                                      */
+/* width / height - размер framebuffer, rotation - 0/90/180/270.       */
+/* Поворот выполняет панель через MADCTL, драйвер пишет строки как есть.*/
+/* ------------------------------------------------------------------ */
+
+static int ili9488_parse_geometry(struct ili9488_par *par)
+{
+	struct device *dev = &par->spi->dev;
+	u32 width = LCD_WIDTH, height = LCD_HEIGHT, rotation = 0;
+	u32 max_w = LCD_WIDTH, max_h = LCD_HEIGHT;
+
+	device_property_read_u32(dev, "width", &width);
+	device_property_read_u32(dev, "height", &height);
+	device_property_read_u32(dev, "rotation", &rotation);
+
+	switch (rotation) {
+	case 0:
+		par->madctl = 0x48;   /* MX | BGR */
+		break;
+	case 90:
+		par->madctl = 0xE8;   /* MY | MX | MV | BGR */
+		swap(max_w, max_h);
+		break;
+	case 180:
+		par->madctl = 0x88;   /* MY | BGR */
+		break;
+	case 270:
+		par->madctl = 0x28;   /* MV | BGR */
+		swap(max_w, max_h);
+		break;
+	default:
+		dev_err(dev, "bad rotation %u\n", rotation);
+		return -EINVAL;
+	}
+
+	if (!width || !height || width > max_w || height > max_h) {
+		dev_err(dev, "bad geometry %ux%u (max %ux%u)\n",
+			width, height, max_w, max_h);
+		return -EINVAL;
+	}
+
+	/* размер одной панели; в span ширина умножится на число панелей */
+	par->width  = width;
+	par->height = height;
+
+	return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Панели                                                               */
+/*                                                                      */
+/* Span: первая панель в DT ссылается на вторую через "ilitek,span",   */
+/* у второй стоит "ilitek,span-secondary". Вторая при probe только     */
+/* готовит GPIO / SPI и ждёт в ili9488_secondaries, framebuffer        */
+/* регистрирует первая (EPROBE_DEFER, пока вторая не появилась).       */
+/*                                                                      */
+/* Mirror: "ilitek,mirror = <&a &b>" на первой, "ilitek,mirror-secondary"*/
+/* на зеркалах. Зеркала показывают то же, что первая панель; damage и  */
+/* упаковка делаются один раз, зеркалам уходит тот же буфер.           */
+/* ------------------------------------------------------------------ */
+
+static LIST_HEAD(ili9488_secondaries);
+static DEFINE_MUTEX(ili9488_secondaries_lock);
+
+static bool ili9488_is_secondary(struct spi_device *spi)
+{
+	return device_property_read_bool(&spi->dev, "ilitek,span-secondary") ||
+	       device_property_read_bool(&spi->dev, "ilitek,mirror-secondary");
+}
+
+static int ili9488_output_setup(struct ili9488_output *out,
+				struct spi_device *spi)
+{
+	int ret;
+
+	out->spi = spi;
+
+	out->reset_gpiod = devm_gpiod_get_optional(&spi->dev,
+						   "reset", GPIOD_OUT_LOW);
+	if (IS_ERR(out->reset_gpiod)) {
+		dev_err(&spi->dev, "reset GPIO error\n");
+		return PTR_ERR(out->reset_gpiod);
+	}
+
+	out->bl_gpiod = devm_gpiod_get_optional(&spi->dev,
+						"backlight", GPIOD_OUT_LOW);
+	if (IS_ERR(out->bl_gpiod)) {
+		dev_err(&spi->dev, "backlight GPIO error\n");
+		return PTR_ERR(out->bl_gpiod);
+	}
+
+	spi->mode          = SPI_MODE_3;
+	spi->bits_per_word = 9;
+	spi->max_speed_hz  = 15000000;
+	ret = spi_setup(spi);
+	if (ret) {
+		dev_err(&spi->dev, "spi_setup failed: %d\n", ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int ili9488_probe_secondary(struct spi_device *spi)
+{
+	struct ili9488_output *out;
+	int ret;
+
+	out = devm_kzalloc(&spi->dev, sizeof(*out), GFP_KERNEL);
+	if (!out)
+		return -ENOMEM;
+
+	ret = ili9488_output_setup(out, spi);
+	if (ret)
+		return ret;
+
+	INIT_WORK(&out->work, ili9488_output_work);
+	init_completion(&out->done);
+	init_completion(&out->xfer_done);
+	spi_set_drvdata(spi, out);
+
+	mutex_lock(&ili9488_secondaries_lock);
+	list_add_tail(&out->node, &ili9488_secondaries);
+	mutex_unlock(&ili9488_secondaries_lock);
+
+	dev_info(&spi->dev, "secondary panel ready\n");
+	return 0;
+}
+
+/* найти вторичную панель по phandle prop[index] и закрепить за par */
+static struct ili9488_output *ili9488_claim(struct ili9488_par *par,
+					    const char *prop, int index)
+{
+	struct device_node    *np;
+	struct ili9488_output *out, *found = NULL;
+
+	np = of_parse_phandle(par->spi->dev.of_node, prop, index);
+	if (!np)
+		return NULL;
+
+	mutex_lock(&ili9488_secondaries_lock);
+	list_for_each_entry(out, &ili9488_secondaries, node) {
+		if (out->spi->dev.of_node == np && !out->par) {
+			found = out;
+			break;
+		}
+	}
+	if (found) {
+		found->par = par;
+		par->panels[par->npanels++] = found;
+	}
+	mutex_unlock(&ili9488_secondaries_lock);
+	of_node_put(np);
+
+	if (!found)
+		return ERR_PTR(-EPROBE_DEFER);
+
+	/* вторичную панель нельзя отвязать раньше framebuffer */
+	if (!device_link_add(&par->spi->dev, &found->spi->dev,
+			     DL_FLAG_AUTOREMOVE_CONSUMER))
+		dev_warn(&par->spi->dev, "no device link to %s\n",
+			 dev_name(&found->spi->dev));
+
+	return found;
+}
+
+static int ili9488_claim_secondaries(struct ili9488_par *par)
+{
+	struct ili9488_output *out;
+	int i;
+
+	out = ili9488_claim(par, "ilitek,span", 0);
+	if (IS_ERR(out))
+		return PTR_ERR(out);
+	if (out)
+		par->out[par->nout++] = out;
+
+	for (i = 0; i < MAX_MIRRORS; i++) {
+		out = ili9488_claim(par, "ilitek,mirror", i);
+		if (IS_ERR(out))
+			return PTR_ERR(out);
+		if (!out)
+			break;
+		par->primary.mirror[par->primary.nmirror++] = out;
+	}
+
+	if (par->nout > 1 && par->primary.nmirror) {
+		dev_err(&par->spi->dev, "span and mirror are exclusive\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void ili9488_release_secondaries(struct ili9488_par *par)
+{
+	int i;
+
+	mutex_lock(&ili9488_secondaries_lock);
+	for (i = 1; i < par->npanels; i++)
+		par->panels[i]->par = NULL;
+	mutex_unlock(&ili9488_secondaries_lock);
+	par->npanels = 1;
+	par->nout    = 1;
+	par->primary.nmirror = 0;
+}
+
 /* ------------------------------------------------------------------ */
 /* Probe                                                                */
 /* ------------------------------------------------------------------ */
 
 static int ili9488_probe(struct spi_device *spi)
 {
-	struct ili9488_par *par;
-	struct fb_info     *info;
-	int ret;
+	struct ili9488_par    *par;
+	struct fb_info        *info;
+	int ret, i;
 
 	dev_info(&spi->dev, "probe start\n");
 
+	if (ili9488_is_secondary(spi))
+		return ili9488_probe_secondary(spi);
+
 	/* 1. Выделяем fb_info + приватные данные */
 	info = framebuffer_alloc(sizeof(struct ili9488_par), &spi->dev);
 	if (!info)
@@ -276,85 +4041,170 @@ static int ili9488_probe(struct spi_device *spi)
 	par->spi  = spi;
 	par->info = info;
 	spi_set_drvdata(spi, par);
+	spin_lock_init(&par->dirty_lock);
+	par->pending_prio = PRIO_IDLE;
+	par->flush_prio   = PRIO_IDLE;
+	par->npackers     = clamp_t(int, pack_cpus ?: num_online_cpus(),
+				    1, MAX_PACKERS);
+	par->colmod       = 0x01;
+	par->bpw          = 1;
+	ili9488_init_lut18(par);
+	mutex_init(&par->flush_lock);
+	INIT_DELAYED_WORK(&par->flush_work, ili9488_flush_work);
+	INIT_DELAYED_WORK(&par->idle_work, ili9488_idle_work);
+	par->panel_since_ns = ktime_get_ns();
+	par->slpout_ns      = par->panel_since_ns;
+	ili9488_qos_add(par);
+	spin_lock_init(&par->pte_lock);
+	INIT_DELAYED_WORK(&par->pte_work, ili9488_pte_work);
 
-	/* 2. Буфер видеопамяти */
-	par->vmem = vzalloc(LCD_BUFSIZE);
-	if (!par->vmem) {
-		ret = -ENOMEM;
+	/* 2. Геометрия, панели (GPIO, SPI), буфер видеопамяти */
+	ret = ili9488_parse_geometry(par);
+	if (ret)
+		goto err_fb_alloc;
+
+	ret = ili9488_output_setup(&par->primary, spi);
+	if (ret)
 		goto err_fb_alloc;
+	par->out[0]    = &par->primary;
+	par->nout      = 1;
+	par->panels[0] = &par->primary;
+	par->npanels   = 1;
+
+	ret = ili9488_claim_secondaries(par);
+	if (ret)
+		goto err_span;
+
+	for (i = 0; i < par->nout; i++) {
+		par->out[i]->x_off = i * par->width;
+		par->out[i]->width = par->width;
 	}
+	par->width    *= par->nout;
+	par->vmem_size = par->width * par->height;
+	par->pack      = ili9488_select_pack(par);
 
-	/* 3. GPIO */
-	par->reset_gpiod = devm_gpiod_get_optional(&spi->dev,
-						   "reset", GPIOD_OUT_LOW);
-	if (IS_ERR(par->reset_gpiod)) {
-		dev_err(&spi->dev, "reset GPIO error\n");
-		ret = PTR_ERR(par->reset_gpiod);
-		goto err_vmem;
+	/* vmalloc_user: обнулённый и пригодный для remap_vmalloc_range */
+	par->vmem = vmalloc_user(par->vmem_size);
+	if (!par->vmem) {
+		ret = -ENOMEM;
+		goto err_span;
 	}
 
-	par->bl_gpiod = devm_gpiod_get_optional(&spi->dev,
-						"backlight", GPIOD_OUT_LOW);
-	if (IS_ERR(par->bl_gpiod)) {
-		dev_err(&spi->dev, "backlight GPIO error\n");
-		ret = PTR_ERR(par->bl_gpiod);
-		goto err_vmem;
+	if (trace_depth) {
+		par->trace = vzalloc(array_size(trace_depth,
+						sizeof(*par->trace)));
+		if (!par->trace) {
+			ret = -ENOMEM;
+			goto err_vmem;
+		}
 	}
 
-	/* 4. SPI */
-	spi->mode          = SPI_MODE_3;
-	spi->bits_per_word = 9;
-	spi->max_speed_hz  = 15000000;
-	ret = spi_setup(spi);
-	if (ret) {
-		dev_err(&spi->dev, "spi_setup failed: %d\n", ret);
-		goto err_vmem;
+	if (gram_model) {
+		par->primary.model = vzalloc(sizeof(*par->primary.model));
+		if (!par->primary.model) {
+			ret = -ENOMEM;
+			goto err_vmem;
+		}
+		ili9488_model_reset(par->primary.model);
 	}
 
-	/* 5. Заполняем fb_info */
-	info->fbops          = &ili9488_fbops;
+	/* 3. Заполняем fb_info */
+	par->fbops           = ili9488_fbops;
+	info->fbops          = &par->fbops;
 	info->fix            = ili9488_fix;
 	info->var            = ili9488_var;
 	info->flags          = FBINFO_DEFAULT | FBINFO_VIRTFB;
 	info->screen_base    = (char __iomem *)par->vmem;
-	info->screen_size    = LCD_BUFSIZE;
+	info->screen_size    = par->vmem_size;
 	info->fix.smem_start = (unsigned long)par->vmem;
-	info->fix.smem_len   = LCD_BUFSIZE;
-
-	/* 6. Deferred IO */
-	info->fbdefio = &ili9488_defio;
-	fb_deferred_io_init(info);
+	info->fix.smem_len   = par->vmem_size;
+	info->fix.line_length = par->width;  /* 1 байт на пиксель */
+	info->var.xres         = par->width;
+	info->var.yres         = par->height;
+	info->var.xres_virtual = par->width;
+	info->var.yres_virtual = par->height;
 
-	/* 7. Инициализация дисплея */
-	ili9488_init_display(par);
+	/* 4. Deferred IO или dirty-биты PTE (mmap ставим так же, как defio) */
+	if (pte_damage) {
+		par->pte_bitmap = bitmap_zalloc(DIV_ROUND_UP(par->vmem_size,
+							     PAGE_SIZE),
+						GFP_KERNEL);
+		if (!par->pte_bitmap) {
+			ret = -ENOMEM;
+			goto err_vmem;
+		}
+		par->fbops.fb_mmap = ili9488_pte_mmap;
+	} else {
+		info->fbdefio = &ili9488_defio;
+		fb_deferred_io_init(info);
+	}
 
-	/* 8. Подсветка */
-	if (par->bl_gpiod) {
-		gpiod_set_value_cansleep(par->bl_gpiod, 1);
-		msleep(10);
+	/* 5. Инициализация дисплеев и подсветка */
+	for (i = 0; i < par->npanels; i++) {
+		ili9488_init_display(par, par->panels[i]);
+		if (par->panels[i]->bl_gpiod) {
+			gpiod_set_value_cansleep(par->panels[i]->bl_gpiod, 1);
+			msleep(10);
+		}
 	}
 
-	/* 9. Чёрный экран при старте */
-	memset(par->vmem, 0x00, LCD_BUFSIZE);
+	/* 6. Чёрный экран при старте */
+	memset(par->vmem, 0x00, par->vmem_size);
+	ili9488_damage(par, 0, 0, par->width, par->height, ILI9488_SRC_INIT);
 	ili9488_flush(par);
 
-	/* 10. Регистрация → создаётся /dev/fb0 */
+	/* 7. Регистрация → создаётся /dev/fb0 */
 	ret = register_framebuffer(info);
 	if (ret) {
 		dev_err(&spi->dev, "register_framebuffer failed: %d\n", ret);
 		goto err_defio;
 	}
 
-	dev_info(&spi->dev, "registered /dev/fb%d, %dx%d, 8bpp (3-bit)\n",
-		 info->node, LCD_WIDTH, LCD_HEIGHT);
+	/* 8. debugfs: /sys/kernel/debug/ili9488_fb/<dev>/ */
+	par->debugfs = debugfs_create_dir(dev_name(&spi->dev),
+					  ili9488_debugfs_root);
+	if (par->trace)
+		debugfs_create_file("trace", 0400, par->debugfs, par,
+				    &ili9488_trace_fops);
+	if (input_latency)
+		debugfs_create_file("latency", 0600, par->debugfs, par,
+				    &ili9488_latency_fops);
+	debugfs_create_file("stats", 0400, par->debugfs, par,
+			    &ili9488_stats_fops);
+	debugfs_create_file_unsafe("hud", 0600, par->debugfs, par,
+				   &ili9488_hud_fops);
+	if (par->primary.model)
+		debugfs_create_file("gram", 0400, par->debugfs, par,
+				    &ili9488_gram_fops);
+
+	/* 9. Текстовый терминал, без него framebuffer работает как обычно */
+	if (term) {
+		ret = ili9488_term_create(par);
+		if (ret)
+			dev_warn(&spi->dev, "no text terminal: %d\n", ret);
+	}
+
+	dev_info(&spi->dev, "registered /dev/fb%d, %dx%d, 8bpp (%s), %d panel(s)\n",
+		 info->node, par->width, par->height,
+		 par->bpw > 1 ? "RGB332, 18-bit" : "3-bit", par->npanels);
 
 	return 0;
 
 err_defio:
-	fb_deferred_io_cleanup(info);
+	if (info->fbdefio)
+		fb_deferred_io_cleanup(info);
+	bitmap_free(par->pte_bitmap);
 err_vmem:
+	cancel_delayed_work_sync(&par->flush_work);
+	cancel_delayed_work_sync(&par->idle_work);
+	vfree(par->trace);
+	vfree(par->primary.model);
+	ili9488_put_buffers(par);
 	vfree(par->vmem);
+err_span:
+	ili9488_release_secondaries(par);
 err_fb_alloc:
+	ili9488_qos_remove(par);
 	framebuffer_release(info);
 	return ret;
 }
@@ -365,15 +4215,46 @@ err_fb_alloc:
 
 static int ili9488_remove(struct spi_device *spi)
 {
-	struct ili9488_par *par  = spi_get_drvdata(spi);
-	struct fb_info     *info = par->info;
+	struct ili9488_par *par;
+	struct fb_info     *info;
+	int i;
+
+	if (ili9488_is_secondary(spi)) {
+		struct ili9488_output *out = spi_get_drvdata(spi);
+
+		mutex_lock(&ili9488_secondaries_lock);
+		list_del(&out->node);
+		mutex_unlock(&ili9488_secondaries_lock);
+		return 0;
+	}
+
+	par  = spi_get_drvdata(spi);
+	info = par->info;
 
-	if (par->bl_gpiod)
-		gpiod_set_value_cansleep(par->bl_gpiod, 0);
+	for (i = 0; i < par->npanels; i++)
+		if (par->panels[i]->bl_gpiod)
+			gpiod_set_value_cansleep(par->panels[i]->bl_gpiod, 0);
 
+	ili9488_term_destroy(par);
+	debugfs_remove_recursive(par->debugfs);
 	unregister_framebuffer(info);
-	fb_deferred_io_cleanup(info);
+	if (info->fbdefio)
+		fb_deferred_io_cleanup(info);
+	/* сначала отвязать: page_mkwrite после этого pte_work не взводит */
+	ili9488_pte_release(par);
+	cancel_delayed_work_sync(&par->pte_work);
+	bitmap_free(par->pte_bitmap);
+	cancel_delayed_work_sync(&par->flush_work);
+	cancel_delayed_work_sync(&par->idle_work);
+	ili9488_qos_remove(par);
+	vfree(par->trace);
+	vfree(par->primary.model);
+	for (i = 0; i < ILI9488_MAX_LAYERS; i++)
+		vfree(par->layers[i].buf);
+	kfree(par->hud_img);
+	ili9488_put_buffers(par);
 	vfree(par->vmem);
+	ili9488_release_secondaries(par);
 	framebuffer_release(info);
 
 	dev_info(&spi->dev, "removed\n");
@@ -397,8 +4278,42 @@ static struct spi_driver ili9488_fb_driver = {
 	.remove = ili9488_remove,
 };
 
-module_spi_driver(ili9488_fb_driver);
+static int __init ili9488_fb_init(void)
+{
+	int ret;
+
+	ili9488_debugfs_root = debugfs_create_dir(DRIVER_NAME, NULL);
+
+	if (input_latency) {
+		ret = input_register_handler(&ili9488_input_handler);
+		if (ret)
+			goto err_debugfs;
+	}
+
+	ret = spi_register_driver(&ili9488_fb_driver);
+	if (ret)
+		goto err_input;
+
+	return 0;
+
+err_input:
+	if (input_latency)
+		input_unregister_handler(&ili9488_input_handler);
+err_debugfs:
+	debugfs_remove_recursive(ili9488_debugfs_root);
+	return ret;
+}
+module_init(ili9488_fb_init);
+
+static void __exit ili9488_fb_exit(void)
+{
+	spi_unregister_driver(&ili9488_fb_driver);
+	if (input_latency)
+		input_unregister_handler(&ili9488_input_handler);
+	debugfs_remove_recursive(ili9488_debugfs_root);
+}
+module_exit(ili9488_fb_exit);
 
 MODULE_AUTHOR("tnv");
-MODULE_DESCRIPTION("ILI9488 framebuffer driver, 3-bit mode, 8 colors");
+MODULE_DESCRIPTION("ILI9488 framebuffer driver, 3-bit / 18-bit colour modes");
 MODULE_LICENSE("GPL");
@@ -0,0 +1,177 @@
+/*
+ * ili9488_fb.h - интерфейс ili9488_fb для userspace
+ *
+ * Трасса damage: /sys/kernel/debug/ili9488_fb/<dev>/trace
+ * Чтение возвращает массив struct ili9488_trace_rec и опустошает буфер.
+ * Запись включается параметром модуля trace_depth=<число записей>.
+ *
+ * ioctl на /dev/fbN - ILI9488_IOC_*.
+ */
+
+#ifndef _ILI9488_FB_H
+#define _ILI9488_FB_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Источник damage */
+enum ili9488_damage_src {
+	ILI9488_SRC_DEFIO     = 0,  /* mmap, страницы из deferred IO */
+	ILI9488_SRC_WRITE     = 1,  /* write() в /dev/fbN */
+	ILI9488_SRC_FILLRECT  = 2,
+	ILI9488_SRC_COPYAREA  = 3,
+	ILI9488_SRC_IMAGEBLIT = 4,
+	ILI9488_SRC_INIT      = 5,  /* полный кадр при старте */
+	ILI9488_SRC_HUD       = 6,  /* debug HUD: показ / восстановление */
+	ILI9488_SRC_LAYER     = 7,  /* ILI9488_IOC_LAYER_* */
+	ILI9488_SRC_SPRITE    = 8,  /* ILI9488_IOC_SPRITE_* */
+	ILI9488_SRC_YUV       = 9,  /* ILI9488_IOC_YUV_FRAME */
+};
+
+/*
+ * Одна запись трассы (24 байта, little-endian как у CPU).
+ * Прямоугольник включительный: x0..x1, y0..y1.
+ * hash - crc32 пикселей vmem внутри прямоугольника на момент события.
+ */
+struct ili9488_trace_rec {
+	__u64 ts_ns;      /* ktime_get_ns() */
+	__u32 hash;
+	__u16 x0, y0;
+	__u16 x1, y1;
+	__u8  source;     /* enum ili9488_damage_src */
+	__u8  pad[3];
+};
+
+/* ------------------------------------------------------------------ */
+/* Слои                                                                 */
+/*                                                                      */
+/* Слой - буфер размера экрана (1 байт на пиксель, как vmem) над vmem. */
+/* Пиксель слоя равный key прозрачен. Слои с большим index выше.       */
+/* В 3-битном режиме key вне 0x00-0x07 (по умолчанию 0xFF) оставляет  */
+/* все 8 цветов. В ILI9488_COLOR_18BIT свободных значений нет: key -   */
+/* один из 256 цветов RGB332 (0xFF - белый), он становится прозрачным, */
+/* выбирайте неиспользуемый.                                           */
+/* В 3-битном режиме LAYER_WRITE с байтом вне 0x00-0x07 (кроме key)    */
+/* возвращает -EINVAL: строки до неё записаны, в ней такие байты       */
+/* заменены на key.                                                    */
+/* ------------------------------------------------------------------ */
+
+#define ILI9488_MAX_LAYERS  2
+
+struct ili9488_layer_cfg {
+	__u32 index;
+	__u32 enable;     /* 0 - выключить и освободить */
+	__u8  key;        /* при включении слой заполняется key */
+	__u8  pad[3];
+};
+
+/* скопировать w*h байт из data в слой в точку (x, y) */
+struct ili9488_layer_blit {
+	__u32 index;
+	__u16 x, y;
+	__u16 w, h;
+	__u64 data;       /* указатель userspace */
+};
+
+/* ------------------------------------------------------------------ */
+/* Спрайт (курсор)                                                      */
+/*                                                                      */
+/* Один спрайт поверх слоёв. mask - 1 бит на пиксель, строки по        */
+/* (w + 7) / 8 байт, старший бит - левый пиксель; 1 - непрозрачный.    */
+/* В 3-битном режиме цвет непрозрачного пикселя вне 0x00-0x07 -        */
+/* -EINVAL. При любой ошибке SPRITE_SET спрайт снимается с экрана.     */
+/* ------------------------------------------------------------------ */
+
+#define ILI9488_SPRITE_MAX  64
+
+struct ili9488_sprite_img {
+	__u16 w, h;       /* до ILI9488_SPRITE_MAX */
+	__u32 pad;
+	__u64 data;       /* w*h байт цвета */
+	__u64 mask;       /* h * ((w + 7) / 8) байт */
+};
+
+/* позиция левого верхнего угла, может быть частично за экраном */
+struct ili9488_sprite_pos {
+	__s16 x, y;
+	__u32 visible;
+};
+
+/* ------------------------------------------------------------------ */
+/* Регионы обновления                                                   */
+/*                                                                      */
+/* Damage внутри региона получает его приоритет и ограничение частоты. */
+/* При пересечении нескольких берётся самый приоритетный. Damage вне  */
+/* регионов - ILI9488_PRIO_NORMAL без ограничения. Более приоритетный  */
+/* damage прерывает отправку менее приоритетного между блоками SPI.    */
+/* ------------------------------------------------------------------ */
+
+#define ILI9488_MAX_REGIONS  4
+
+#define ILI9488_PRIO_URGENT  0  /* flush сразу, без DEFIO_DELAY */
+#define ILI9488_PRIO_NORMAL  1
+#define ILI9488_PRIO_LOW     2
+#define ILI9488_PRIO_BULK    3
+
+struct ili9488_region {
+	__u32 index;
+	__u16 x, y;
+	__u16 w, h;       /* w == 0 или h == 0 - удалить регион */
+	__u8  prio;       /* ILI9488_PRIO_* */
+	__u8  pad[3];
+	__u32 max_hz;     /* 0 - без ограничения */
+};
+
+/* ------------------------------------------------------------------ */
+/* Кадр камеры                                                          */
+/*                                                                      */
+/* Кадр YUV 4:2:0 (BT.601, limited range) из памяти userspace: область */
+/* crop_* уменьшается усреднением до w*h и пишется в vmem в точку      */
+/* (x, y) с квантованием до 3 бит (RGB332 в ILI9488_COLOR_18BIT).     */
+/* Только уменьшение: w <= crop_w, h <= crop_h.                        */
+/* Плоскость Y - stride байт на строку, за ней:                        */
+/*   NV12 - UV вперемежку, stride байт на строку;                      */
+/*   I420 - U, затем V, по (stride + 1) / 2 байт на строку.            */
+/* ------------------------------------------------------------------ */
+
+#define ILI9488_YUV_NV12     0
+#define ILI9488_YUV_I420     1
+
+#define ILI9488_DITHER_NONE     0  /* порог 50% */
+#define ILI9488_DITHER_ORDERED  1  /* Байер 4x4 */
+
+struct ili9488_yuv_frame {
+	__u32 format;     /* ILI9488_YUV_* */
+	__u16 width, height;
+	__u32 stride;     /* байт на строку Y, >= width */
+	__u16 crop_x, crop_y;
+	__u16 crop_w, crop_h;
+	__u16 x, y;       /* куда на экране */
+	__u16 w, h;
+	__u8  dither;     /* ILI9488_DITHER_* */
+	__u8  pad[3];
+	__u64 data;       /* указатель userspace на начало плоскости Y */
+};
+
+/* ------------------------------------------------------------------ */
+/* Цветовой режим                                                       */
+/*                                                                      */
+/* 3BIT  - COLMOD 0x01: байт vmem - цвет в битах 2..0, 1 слово SPI.    */
+/* 18BIT - COLMOD 0x66: байт vmem - RGB332, 3 слова SPI на пиксель,   */
+/*         полный кадр втрое дольше. fb_var_screeninfo меняется.       */
+/* Оценка fps обоих режимов - proj_fps_* в debugfs stats.             */
+/* ------------------------------------------------------------------ */
+
+#define ILI9488_COLOR_3BIT   0
+#define ILI9488_COLOR_18BIT  1
+
+#define ILI9488_IOC_MAGIC        'i'
+#define ILI9488_IOC_LAYER_SET    _IOW(ILI9488_IOC_MAGIC, 1, struct ili9488_layer_cfg)
+#define ILI9488_IOC_LAYER_WRITE  _IOW(ILI9488_IOC_MAGIC, 2, struct ili9488_layer_blit)
+#define ILI9488_IOC_SPRITE_SET   _IOW(ILI9488_IOC_MAGIC, 3, struct ili9488_sprite_img)
+#define ILI9488_IOC_SPRITE_MOVE  _IOW(ILI9488_IOC_MAGIC, 4, struct ili9488_sprite_pos)
+#define ILI9488_IOC_REGION_SET   _IOW(ILI9488_IOC_MAGIC, 5, struct ili9488_region)
+#define ILI9488_IOC_YUV_FRAME    _IOW(ILI9488_IOC_MAGIC, 6, struct ili9488_yuv_frame)
+#define ILI9488_IOC_COLOR_MODE   _IOW(ILI9488_IOC_MAGIC, 7, __u32)
+
+#endif /* _ILI9488_FB_H */
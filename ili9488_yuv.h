@@ -0,0 +1,128 @@
+/*
+ * ili9488_yuv.h - преобразование кадра камеры для ILI9488_IOC_YUV_FRAME
+ *
+ * Общий код драйвера (ili9488.c) и ili9488-bench (-y): усреднение по
+ * площади, BT.601 -> RGB и квантование. Только типы linux/types.h,
+ * без вызовов ядра или libc: одни и те же функции собираются в модуль
+ * и в userspace, так что результат можно сверить на хосте по файлам.
+ *
+ * Порядок: для каждой исходной строки ili9488_yuv_acc_row(), когда
+ * строки для строки приёмника dy кончились - ili9488_yuv_emit_row() и
+ * обнулить acc / cnt.
+ */
+
+#ifndef _ILI9488_YUV_H
+#define _ILI9488_YUV_H
+
+#include <linux/types.h>
+
+#include "ili9488_fb.h"
+
+/* порог на канал 0..255 для упорядоченного dither */
+static const __u8 ili9488_bayer4[4][4] = {
+	{   8, 136,  40, 168 },
+	{ 200,  72, 232, 104 },
+	{  56, 184,  24, 152 },
+	{ 248, 120, 216,  88 },
+};
+
+static inline int ili9488_yuv_clamp8(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/*
+ * YUV (BT.601, 16..235) -> 3 бита RGB 1-1-1. Целочисленно, коэффициенты
+ * * 256; нужен только знак относительно порога, так что без clamp.
+ */
+static inline __u8 ili9488_yuv_px(int y, int u, int v, int thr)
+{
+	int c = 298 * (y - 16) + 128;
+	int d = u - 128;
+	int e = v - 128;
+	int t = thr << 8;
+	__u8 px = 0;
+
+	if (c + 409 * e > t)
+		px |= 0x04;
+	if (c - 100 * d - 208 * e > t)
+		px |= 0x02;
+	if (c + 516 * d > t)
+		px |= 0x01;
+	return px;
+}
+
+/*
+ * То же для 18-битного режима: RGB332. Порог dither сдвигает канал в
+ * пределах одного шага квантования (32 для R / G, 64 для B).
+ */
+static inline __u8 ili9488_yuv_px332(int y, int u, int v, int thr)
+{
+	int c = 298 * (y - 16) + 128;
+	int d = u - 128;
+	int e = v - 128;
+	int o = thr - 128;
+	int r = ili9488_yuv_clamp8((c + 409 * e) >> 8);
+	int g = ili9488_yuv_clamp8((c - 100 * d - 208 * e) >> 8);
+	int b = ili9488_yuv_clamp8((c + 516 * d) >> 8);
+
+	r = ili9488_yuv_clamp8(r + o / 8 + 16) >> 5;
+	g = ili9488_yuv_clamp8(g + o / 8 + 16) >> 5;
+	b = ili9488_yuv_clamp8(b + o / 4 + 32) >> 6;
+	return r << 5 | g << 2 | b;
+}
+
+/*
+ * Одна исходная строка crop в суммы acc[3 * w] (Y, U, V) и cnt[w].
+ * ybuf - crop_w байт Y, cbuf - цветность пар пикселей cx0..cx0+cn-1:
+ * NV12 - UVUV..., I420 - U[cn], затем V[cn]. xmap[sx] - столбец
+ * приёмника для столбца crop sx.
+ */
+static inline void ili9488_yuv_acc_row(const struct ili9488_yuv_frame *f,
+				       __u32 *acc, __u32 *cnt,
+				       const __u16 *xmap, const __u8 *ybuf,
+				       const __u8 *cbuf, int cx0, int cn)
+{
+	int nv12 = f->format == ILI9488_YUV_NV12;
+	int sx;
+
+	for (sx = 0; sx < f->crop_w; sx++) {
+		int dx = xmap[sx];
+		int k  = (f->crop_x + sx) / 2 - cx0;
+
+		acc[dx]            += ybuf[sx];
+		acc[f->w + dx]     += nv12 ? cbuf[2 * k] : cbuf[k];
+		acc[2 * f->w + dx] += nv12 ? cbuf[2 * k + 1] : cbuf[cn + k];
+		cnt[dx]++;
+	}
+}
+
+/*
+ * Строка приёмника dy из сумм: среднее и квантование в dst[0..w-1]
+ * (экранная строка f->y + dy с точки f->x). rgb332 - 18-битный режим.
+ */
+static inline void ili9488_yuv_emit_row(const struct ili9488_yuv_frame *f,
+					int dy, const __u32 *acc,
+					const __u32 *cnt, __u8 *dst,
+					int rgb332)
+{
+	const __u32 *ay = acc;
+	const __u32 *au = acc + f->w;
+	const __u32 *av = acc + 2 * f->w;
+	int py = f->y + dy;
+	int dx;
+
+	for (dx = 0; dx < f->w; dx++) {
+		int thr = f->dither ? ili9488_bayer4[py & 3][(f->x + dx) & 3]
+				    : 128;
+
+		int y = ay[dx] / cnt[dx];
+		int u = au[dx] / cnt[dx];
+		int v = av[dx] / cnt[dx];
+
+		dst[dx] = rgb332 ? ili9488_yuv_px332(y, u, v, thr) :
+				   ili9488_yuv_px(y, u, v, thr);
+	}
+}
+
+#endif /* _ILI9488_YUV_H */